@@ -0,0 +1,108 @@
+#ifndef MYLLVMPASS_COMMON_INSTKEY_H
+#define MYLLVMPASS_COMMON_INSTKEY_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
+
+#include <utility>
+
+// Expression key of an instruction, shared by the CSE and PRE passes so
+// that both agree on when two instructions compute the same value. Besides
+// opcode, type and operands the key carries everything else that changes
+// what an instruction computes. Poison-generating flags are left out on
+// purpose; they are intersected when two instructions are merged.
+//
+// A key does not own its arrays: they point into the buffers it was built
+// in, and copyInstKey moves them into an arena for keys that are stored.
+struct InstKey {
+  unsigned Opcode = 0;
+  // compare predicate or calling convention, 0 otherwise
+  unsigned SubclassData = 0;
+  llvm::Type *Ty = nullptr;
+  // source element type of a GEP, function type of a call
+  llvm::Type *SrcElemTy = nullptr;
+  llvm::ArrayRef<llvm::Value *> Ops;
+  // extractvalue/insertvalue indices or shufflevector mask
+  llvm::ArrayRef<int> Imms;
+
+  unsigned hash() const {
+    // combine opcode, type, operand pointers and extra data into a hash
+    return (unsigned)llvm::hash_combine(
+        Opcode, SubclassData, Ty, SrcElemTy,
+        llvm::hash_combine_range(Ops.begin(), Ops.end()),
+        llvm::hash_combine_range(Imms.begin(), Imms.end()));
+  }
+
+  bool operator==(const InstKey &O) const {
+    // LLVM IR is SSA format, so we can use pointer equality for operands.
+    return Opcode == O.Opcode && SubclassData == O.SubclassData &&
+           Ty == O.Ty && SrcElemTy == O.SrcElemTy && Ops == O.Ops &&
+           Imms == O.Imms;
+  }
+};
+
+struct InstKeyHash {
+  size_t operator()(const InstKey &K) const { return K.hash(); }
+};
+
+// Build the key of I computing on the operands in Ops, which are usually
+// I's own operands. For commutative instructions the operand order is
+// canonicalized by pointer value to catch operand-swapped duplicates;
+// compares are canonicalized the same way by swapping the predicate along
+// with the operands, so a < b matches b > a. Ops is reordered in place and
+// Imms receives the immediates; the key points into both.
+inline InstKey makeInstKey(llvm::Instruction *I,
+                           llvm::SmallVectorImpl<llvm::Value *> &Ops,
+                           llvm::SmallVectorImpl<int> &Imms) {
+  using namespace llvm;
+  Imms.clear();
+
+  InstKey K;
+  K.Opcode = I->getOpcode();
+  K.Ty = I->getType();
+  if (auto *Cmp = dyn_cast<CmpInst>(I)) {
+    CmpInst::Predicate Pred = Cmp->getPredicate();
+    if ((uintptr_t)Ops[0] > (uintptr_t)Ops[1]) {
+      std::swap(Ops[0], Ops[1]);
+      Pred = CmpInst::getSwappedPredicate(Pred);
+    }
+    K.SubclassData = Pred;
+  } else if (auto *GEP = dyn_cast<GetElementPtrInst>(I)) {
+    K.SrcElemTy = GEP->getSourceElementType();
+  } else if (auto *EVI = dyn_cast<ExtractValueInst>(I)) {
+    Imms.append(EVI->idx_begin(), EVI->idx_end());
+  } else if (auto *IVI = dyn_cast<InsertValueInst>(I)) {
+    Imms.append(IVI->idx_begin(), IVI->idx_end());
+  } else if (auto *SVI = dyn_cast<ShuffleVectorInst>(I)) {
+    Imms.append(SVI->getShuffleMask().begin(), SVI->getShuffleMask().end());
+  } else if (auto *CB = dyn_cast<CallBase>(I)) {
+    K.SubclassData = CB->getCallingConv();
+    K.SrcElemTy = CB->getFunctionType();
+  }
+
+  // for commutative intrinsics the first two operands are the commuted
+  // arguments
+  if (I->isCommutative() && Ops.size() >= 2) {
+    if ((uintptr_t)Ops[0] > (uintptr_t)Ops[1])
+      std::swap(Ops[0], Ops[1]);
+  }
+  K.Ops = Ops;
+  K.Imms = Imms;
+  return K;
+}
+
+// Copy the arrays of K into Arena, so the key outlives its buffers. Any
+// allocator with the Allocate<T>(Num) interface of BumpPtrAllocator will do.
+template <typename AllocatorT>
+InstKey copyInstKey(InstKey K, AllocatorT &Arena) {
+  if (!K.Ops.empty())
+    K.Ops = K.Ops.copy(Arena);
+  if (!K.Imms.empty())
+    K.Imms = K.Imms.copy(Arena);
+  return K;
+}
+
+#endif // MYLLVMPASS_COMMON_INSTKEY_H
@@ -1,104 +1,439 @@
+#include "Common/InstKey.h"
+
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Local.h>
 
-#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 using namespace llvm;
 
 namespace {
+
+// Options of the pass, spelled CommonSubexpressionElimination<global;memory>.
+struct CommonSubexpressionEliminationOptions {
+  bool Global = false;
+  bool Memory = false;
+};
+
 class ThePass : public PassInfoMixin<ThePass> {
 private:
-  // We need to create a map to track seen instructions.
-  struct InstKey {
-    unsigned Opcode;
-    Type *Ty;
-    SmallVector<Value *, 4> Ops;
+  CommonSubexpressionEliminationOptions Opts;
+
+  // We need to create a map to track seen instructions, keyed by InstKey
+  // (Common/InstKey.h). Keys built for a lookup point into the scratch
+  // buffers of the CSE state, and only keys that are inserted get their
+  // arrays copied into its arena.
+
+  // Bump allocator for the arrays of stored keys that can be released back
+  // to a mark. Keys leave the tables newest first, and their arrays are the
+  // newest allocations, so releasing to the mark taken at a scope entry
+  // frees exactly the arrays of the keys the scope added. Released slabs
+  // are kept for reuse.
+  class KeyArena {
+    static constexpr size_t SlabSize = 4096;
+    struct Slab {
+      std::unique_ptr<char[]> Data;
+      size_t Size;
+    };
+    std::vector<Slab> Slabs;
+    // slab being filled and the bytes used in it
+    size_t Cur = 0;
+    size_t Offset = 0;
+
+  public:
+    struct Mark {
+      size_t Cur;
+      size_t Offset;
+    };
+
+    KeyArena() {
+      Slabs.push_back({std::make_unique<char[]>(SlabSize), SlabSize});
+    }
+
+    Mark mark() const { return {Cur, Offset}; }
+    // Free everything allocated since M was taken.
+    void release(Mark M) {
+      Cur = M.Cur;
+      Offset = M.Offset;
+    }
+
+    template <typename T> T *Allocate(size_t Num) {
+      size_t Size = Num * sizeof(T);
+      Offset = alignTo(Offset, alignof(T));
+      if (Offset + Size > Slabs[Cur].Size) {
+        ++Cur;
+        Offset = 0;
+        // a released slab too small for this array stays for later ones
+        if (Cur == Slabs.size() || Slabs[Cur].Size < Size) {
+          size_t NewSize = std::max(SlabSize, Size);
+          Slabs.insert(Slabs.begin() + Cur,
+                       {std::make_unique<char[]>(NewSize), NewSize});
+        }
+      }
+      T *P = reinterpret_cast<T *>(Slabs[Cur].Data.get() + Offset);
+      Offset += Size;
+      return P;
+    }
   };
 
-  struct InstKeyHash {
-    size_t operator()(InstKey const &K) const noexcept {
-      // combine opcode, type, and operand pointers into a hash
-      size_t h = (size_t)K.Opcode;
-      h = llvm::hash_combine(h, (uintptr_t)K.Ty);
-      for (Value *V : K.Ops)
-        h = llvm::hash_combine(h, (uintptr_t)V);
-      return h;
+  // Open-addressing hash table with linear probing, specialised for the
+  // scoped use in CSE: entries only ever leave the table in the reverse
+  // order of their insertion. The newest entry never lies on the probe path
+  // of an older one, so removing it just empties its bucket and no
+  // tombstones are needed. Entries are kept in insertion order together
+  // with their hash, so rolling back is a pop and growing never rehashes a
+  // key; rolling back keeps all the memory for reuse.
+  template <typename ValueT> class ExprTable {
+  public:
+    struct Entry {
+      InstKey Key;
+      unsigned Hash;
+      unsigned Bucket;
+      ValueT Value;
+    };
+
+  private:
+    static constexpr unsigned EmptyBucket = ~0U;
+    std::vector<Entry> Entries;
+    std::vector<unsigned> Buckets;
+
+    unsigned findBucket(const InstKey &K, unsigned Hash) const {
+      unsigned Mask = Buckets.size() - 1;
+      for (unsigned B = Hash & Mask;; B = (B + 1) & Mask) {
+        unsigned Idx = Buckets[B];
+        if (Idx == EmptyBucket)
+          return B;
+        const Entry &E = Entries[Idx];
+        if (E.Hash == Hash && E.Key == K)
+          return B;
+      }
+    }
+
+    void grow() {
+      Buckets.assign(std::max<size_t>(64, Buckets.size() * 2), EmptyBucket);
+      for (unsigned Idx = 0, N = Entries.size(); Idx != N; ++Idx) {
+        Entry &E = Entries[Idx];
+        E.Bucket = findBucket(E.Key, E.Hash);
+        Buckets[E.Bucket] = Idx;
+      }
+    }
+
+  public:
+    size_t size() const { return Entries.size(); }
+    Entry &operator[](size_t Idx) { return Entries[Idx]; }
+
+    // Index of the entry for K, or -1.
+    long lookup(const InstKey &K, unsigned Hash) const {
+      if (Buckets.empty())
+        return -1;
+      unsigned Idx = Buckets[findBucket(K, Hash)];
+      return Idx == EmptyBucket ? -1 : (long)Idx;
+    }
+
+    // Add an entry for a key that is not in the table yet. The key must
+    // outlive the entry.
+    void insert(const InstKey &K, unsigned Hash, ValueT V) {
+      // keep the load factor at or below 3/4
+      if ((Entries.size() + 1) * 4 > Buckets.size() * 3)
+        grow();
+      unsigned B = findBucket(K, Hash);
+      Buckets[B] = Entries.size();
+      Entries.push_back({K, Hash, B, V});
+    }
+
+    // Drop the newest entries until Size remain.
+    void rollback(size_t Size) {
+      while (Entries.size() > Size) {
+        Buckets[Entries.back().Bucket] = EmptyBucket;
+        Entries.pop_back();
+      }
     }
   };
 
-  struct InstKeyEq {
-    bool operator()(InstKey const &A, InstKey const &B) const noexcept {
-      if (A.Opcode != B.Opcode)
-        return false;
-      if (A.Ty != B.Ty)
+  // A value read from memory (a load, a forwarded store, a readonly call)
+  // and the memory generation it was read in.
+  struct MemoryValue {
+    Value *V;
+    unsigned Generation;
+  };
+
+  // Undo record of a memory table update: the entry to drop, or to restore
+  // to its previous value if it was overwritten.
+  struct MemoryUndoEntry {
+    size_t Index;
+    bool HadOld;
+    MemoryValue Old;
+  };
+
+  // Expressions available at the current point of the walk. The entries of
+  // Available are in insertion order, so a scope is retracted by rolling
+  // the table back to its size at the scope entry and releasing the arena
+  // to its mark; memory table updates are logged in MemoryUndo because an
+  // entry may be overwritten in place.
+  //
+  // Memory is versioned by a generation number: anything that may write
+  // memory starts a new generation, and a memory value is only reused while
+  // its generation is still the current one.
+  struct CSEState {
+    ExprTable<Instruction *> Available;
+    ExprTable<MemoryValue> AvailableMemory;
+    std::vector<MemoryUndoEntry> MemoryUndo;
+    unsigned Generation = 0;
+    // last generation number handed out, they are never reused
+    unsigned LastGeneration = 0;
+
+    // Operand and immediate arrays of the stored keys.
+    KeyArena Arena;
+    // Arrays of the key being looked up.
+    SmallVector<Value *, 8> OpsScratch;
+    SmallVector<int, 8> ImmsScratch;
+
+    // Forget every expression but keep the memory for the next scope.
+    void reset() {
+      Available.rollback(0);
+      AvailableMemory.rollback(0);
+      MemoryUndo.clear();
+      Arena.release({0, 0});
+      clobberMemory();
+    }
+
+    // Copy the arrays of a scratch key into the arena.
+    InstKey persist(const InstKey &K) { return copyInstKey(K, Arena); }
+
+    void clobberMemory() { Generation = ++LastGeneration; }
+
+    void addMemoryValue(const InstKey &K, Value *V) {
+      unsigned Hash = K.hash();
+      long Idx = AvailableMemory.lookup(K, Hash);
+      if (Idx >= 0) {
+        MemoryValue &MV = AvailableMemory[Idx].Value;
+        MemoryUndo.push_back({(size_t)Idx, true, MV});
+        MV = {V, Generation};
+        return;
+      }
+      MemoryUndo.push_back({AvailableMemory.size(), false, {}});
+      AvailableMemory.insert(persist(K), Hash, {V, Generation});
+    }
+
+    void retractMemoryValue() {
+      MemoryUndoEntry &E = MemoryUndo.back();
+      if (E.HadOld)
+        AvailableMemory[E.Index].Value = E.Old;
+      else
+        AvailableMemory.rollback(E.Index);
+      MemoryUndo.pop_back();
+    }
+  };
+
+  // Build a key for an instruction in the scratch buffers of State.
+  static InstKey makeKey(Instruction *I, CSEState &State) {
+    State.OpsScratch.assign(I->op_begin(), I->op_end());
+    return makeInstKey(I, State.OpsScratch, State.ImmsScratch);
+  }
+
+  // Load and store keys are both spelled as the load of Ty from Ptr.
+  static InstKey makeLoadKey(Value *Ptr, Type *Ty, CSEState &State) {
+    State.OpsScratch.assign(1, Ptr);
+    State.ImmsScratch.clear();
+    InstKey K;
+    K.Opcode = Instruction::Load;
+    K.Ty = Ty;
+    K.Ops = State.OpsScratch;
+    return K;
+  }
+
+  // I is about to be replaced by Prev, so Prev now stands for both: keep
+  // only the flags and metadata that hold for each of them.
+  static void mergeInto(Instruction *Prev, Instruction &I) {
+    if (Prev->getOpcode() != I.getOpcode())
+      return;
+    Prev->andIRFlags(&I);
+    combineMetadataForCSE(Prev, &I, /*DoesKMove=*/false);
+  }
+
+  // Memory-aware CSE: simple loads are reused while no write intervenes,
+  // a simple store makes its value available to later loads of the same
+  // address, and readonly calls are reused like loads.
+  bool processMemoryInstruction(Instruction &I, CSEState &State,
+                                SmallVectorImpl<Instruction *> &ToErase) {
+    InstKey K;
+    if (auto *LI = dyn_cast<LoadInst>(&I)) {
+      if (!LI->isSimple()) {
+        State.clobberMemory();
         return false;
-      if (A.Ops.size() != B.Ops.size())
+      }
+      K = makeLoadKey(LI->getPointerOperand(), LI->getType(), State);
+    } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+      State.clobberMemory();
+      if (SI->isSimple())
+        State.addMemoryValue(makeLoadKey(SI->getPointerOperand(),
+                                         SI->getValueOperand()->getType(),
+                                         State),
+                             SI->getValueOperand());
+      return false;
+    } else if (isa<CallInst>(&I) && cast<CallInst>(&I)->onlyReadsMemory() &&
+               !I.mayHaveSideEffects()) {
+      K = makeKey(&I, State);
+    } else {
+      if (I.mayWriteToMemory())
+        State.clobberMemory();
+      return false;
+    }
+
+    long Idx = State.AvailableMemory.lookup(K, K.hash());
+    if (Idx >= 0 &&
+        State.AvailableMemory[Idx].Value.Generation == State.Generation) {
+      Value *Prev = State.AvailableMemory[Idx].Value.V;
+      if (auto *PrevI = dyn_cast<Instruction>(Prev))
+        mergeInto(PrevI, I);
+      I.replaceAllUsesWith(Prev);
+      ToErase.push_back(&I);
+      errs() << "CSE: replaced " << I << " with " << *Prev << "\n";
+      return true;
+    }
+    State.addMemoryValue(K, &I);
+    return false;
+  }
+
+  // Look I up among the available expressions. A duplicate is replaced and
+  // queued for deletion, anything else becomes available.
+  bool processInstruction(Instruction &I, CSEState &State,
+                          SmallVectorImpl<Instruction *> &ToErase) {
+    // Skip PHI nodes and terminators. EH pads must stay first in their
+    // block and tokens cannot flow through PHIs, so neither is merged.
+    if (isa<PHINode>(&I) || I.isTerminator() || I.isEHPad() ||
+        I.getType()->isTokenTy())
+      return false;
+
+    // Memory operations take the generation-checked path, or are skipped
+    if (I.mayReadOrWriteMemory()) {
+      if (Opts.Memory)
+        return processMemoryInstruction(I, State, ToErase);
+      return false;
+    }
+
+    // Skip instructions with side effects. Every alloca is a distinct
+    // object and convergent calls must not move between blocks, so neither
+    // may be merged even though both look pure.
+    if (I.mayHaveSideEffects() || isa<AllocaInst>(&I))
+      return false;
+    if (auto *CB = dyn_cast<CallBase>(&I))
+      if (CB->isConvergent())
         return false;
-      // LLVM IR is SSA format, so we can use pointer equality for operands.
-      for (unsigned i = 0, e = A.Ops.size(); i != e; ++i)
-        if (A.Ops[i] != B.Ops[i])
-          return false;
+
+    // Build key
+    InstKey K = makeKey(&I, State);
+    unsigned Hash = K.hash();
+
+    long Idx = State.Available.lookup(K, Hash);
+    if (Idx >= 0) {
+      Instruction *Prev = State.Available[Idx].Value;
+      // Replace uses of I with Prev and mark I for deletion
+      mergeInto(Prev, I);
+      I.replaceAllUsesWith(Prev);
+      ToErase.push_back(&I);
+      errs() << "CSE: replaced " << I << " with " << *Prev << "\n";
       return true;
     }
-  };
+    State.Available.insert(State.persist(K), Hash, &I);
+    return false;
+  }
 
-  // Build a key for an instruction. For commutative instructions we
-  // canonicalize operand order by pointer value to catch operand-swapped
-  // duplicates.
-  InstKey makeKey(Instruction *I) {
-    InstKey K;
-    K.Opcode = I->getOpcode();
-    K.Ty = I->getType();
-    for (Use &U : I->operands())
-      K.Ops.push_back(U.get());
+  // Global CSE: walk the dominator tree depth first with a scoped hash table.
+  // Expressions computed in a block stay available in the whole subtree it
+  // dominates and are retracted when the walk leaves the subtree, so every
+  // dominated recomputation is found in one linear pass.
+  bool runGlobal(DominatorTree &DT) {
+    bool Changed = false;
+    CSEState State;
+    SmallVector<Instruction *, 16> ToErase;
+
+    struct Scope {
+      DomTreeNode *Node;
+      DomTreeNode::const_iterator NextChild;
+      size_t AvailableSize;
+      size_t MemoryUndoSize;
+      KeyArena::Mark ArenaMark;
+      // memory generation at the end of the block, inherited by children
+      unsigned Generation;
+    };
+    SmallVector<Scope, 16> Stack;
+
+    auto Enter = [&](DomTreeNode *N) {
+      BasicBlock *BB = N->getBlock();
+      // memory is only unchanged since the parent if the parent is the
+      // sole way in
+      BasicBlock *Parent = Stack.empty() ? nullptr : Stack.back().Node->getBlock();
+      if (Stack.empty() || BB->getSinglePredecessor() != Parent)
+        State.clobberMemory();
+      else
+        State.Generation = Stack.back().Generation;
 
-    // canonicalize operand order
-    if (I->isCommutative() && K.Ops.size() == 2) {
-      if ((uintptr_t)K.Ops[0] > (uintptr_t)K.Ops[1])
-        std::swap(K.Ops[0], K.Ops[1]);
+      Stack.push_back({N, N->begin(), State.Available.size(),
+                       State.MemoryUndo.size(), State.Arena.mark(), 0});
+      for (Instruction &I : *BB)
+        Changed |= processInstruction(I, State, ToErase);
+      Stack.back().Generation = State.Generation;
+    };
+
+    Enter(DT.getRootNode());
+    while (!Stack.empty()) {
+      Scope &S = Stack.back();
+      if (S.NextChild != S.Node->end()) {
+        Enter(*S.NextChild++);
+        continue;
+      }
+      // leaving the subtree: its expressions are no longer available
+      State.Available.rollback(S.AvailableSize);
+      while (State.MemoryUndo.size() > S.MemoryUndoSize)
+        State.retractMemoryValue();
+      State.Arena.release(S.ArenaMark);
+      Stack.pop_back();
     }
-    return K;
+
+    // Erase dead instructions
+    for (Instruction *D : ToErase) {
+      if (D->use_empty())
+        D->eraseFromParent();
+    }
+    return Changed;
   }
 
 public:
+  explicit ThePass(CommonSubexpressionEliminationOptions Opts = {})
+      : Opts(Opts) {}
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    if (Opts.Global) {
+      DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+      return runGlobal(DT) ? PreservedAnalyses::none()
+                          : PreservedAnalyses::all();
+    }
+
     bool Changed = false;
 
     // Iterate over blocks and perform a simple local CSE: within a basic block,
     // if an instruction computes the same opcode and operands as a prior
     // instruction (and is safe to replace), replace uses and erase the dup.
+    CSEState State;
+    SmallVector<Instruction *, 16> ToErase;
     for (BasicBlock &BB : F) {
-      std::unordered_map<InstKey, Instruction *, InstKeyHash, InstKeyEq> Seen;
-      SmallVector<Instruction *, 16> ToErase;
-
-      for (Instruction &I : BB) {
-        // Skip PHI nodes and terminators
-        if (isa<PHINode>(&I) || I.isTerminator())
-          continue;
-
-        // Skip instructions with side effects or memory operations
-        if (I.mayHaveSideEffects() || I.mayReadOrWriteMemory())
-          continue;
-
-        // Build key
-        InstKey K = makeKey(&I);
-
-        auto It = Seen.find(K);
-        if (It != Seen.end()) {
-          Instruction *Prev = It->second;
-          // Replace uses of I with Prev and mark I for deletion
-          I.replaceAllUsesWith(Prev);
-          ToErase.push_back(&I);
-          Changed = true;
-          errs() << "CSE: replaced " << I << " with " << *Prev << "\n";
-        } else {
-          Seen.emplace(std::move(K), &I);
-        }
-      }
+      // one state serves all blocks, its memory is reused from block to
+      // block
+      State.reset();
+      ToErase.clear();
+
+      for (Instruction &I : BB)
+        Changed |= processInstruction(I, State, ToErase);
 
       // Erase dead instructions
       for (Instruction *D : ToErase) {
@@ -110,6 +445,23 @@ public:
     return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 };
+
+// Parse `CommonSubexpressionElimination<opt1;opt2;...>`.
+bool parseOptions(StringRef Name, CommonSubexpressionEliminationOptions &Opts) {
+  if (!Name.consume_front(PASS_NAME "<") || !Name.consume_back(">"))
+    return false;
+  SmallVector<StringRef, 2> Params;
+  Name.split(Params, ';');
+  for (StringRef Param : Params) {
+    if (Param == "global")
+      Opts.Global = true;
+    else if (Param == "memory")
+      Opts.Memory = true;
+    else
+      return false;
+  }
+  return true;
+}
 } // end anonymous namespace
 
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -122,6 +474,11 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     FPM.addPass(ThePass());
                     return true;
                   }
+                  CommonSubexpressionEliminationOptions Opts;
+                  if (parseOptions(Name, Opts)) {
+                    FPM.addPass(ThePass(Opts));
+                    return true;
+                  }
                   return false;
                 });
           }};
@@ -0,0 +1,27 @@
+// Micro-benchmark for the CSE pass: one straight-line function of about
+// 150000 instructions, a third of which are redundant. Run it through the
+// pass with `-time-passes` (see README.md) to compare hash table
+// implementations.
+
+#define STEP                                                                   \
+  a = a * 3 + b;                                                               \
+  b = (b ^ a) + 7;                                                             \
+  s += a + b;                                                                  \
+  s += b + a;   /* redundant: commuted */                                      \
+  s += (a ^ b); /* redundant: computed above */
+#define STEP4 STEP STEP STEP STEP
+#define STEP16 STEP4 STEP4 STEP4 STEP4
+#define STEP64 STEP16 STEP16 STEP16 STEP16
+#define STEP256 STEP64 STEP64 STEP64 STEP64
+#define STEP1024 STEP256 STEP256 STEP256 STEP256
+#define STEP16384 STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 \
+  STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 STEP1024 \
+  STEP1024 STEP1024
+
+int straight_line(int a, int b) {
+  int s = 0;
+  STEP16384
+  return s;
+}
+
+int main(void) { return straight_line(1, 2) & 0xff; }
@@ -16,8 +16,43 @@ int reassign(int x, int y) {
   return a + b;
 }
 
+int dominated(int x, int y, int c) {
+  int a = x + y;
+  int r;
+  if (c)
+    r = (y + x) * 2; // redundant in a dominated block: needs <global>
+  else
+    r = x - y;
+  int d = x - y;     // not redundant: the else block does not dominate here
+  return a + r + d;
+}
+
+int loads(int *p, int *q) {
+  int a = *p;
+  int b = *p;  // redundant load: needs <memory>
+  *q = a + 1;
+  int c = *q;  // forwarded from the store above
+  int d = *p;  // not redundant: the store to q may have changed *p
+  return a + b + c + d;
+}
+
+int compares(int x, int y, int *p) {
+  int lt = x < y;
+  int gt = y > x;    // redundant: the same compare with swapped operands
+  int ge = x >= y;   // not redundant: different predicate
+  int s1 = p[x + 1];
+  int s2 = p[1 + x]; // index and address are redundant, the load needs <memory>
+  return lt + gt + ge + s1 + s2;
+}
+
 int main(void) {
   int r = compute(10, 20);
   r += reassign(10, 20);
+  r += dominated(10, 20, 1);
+  int m = 3;
+  int n = 0;
+  r += loads(&m, &n);
+  int arr[4] = {1, 2, 3, 4};
+  r += compares(1, 2, arr);
   return r;
 }
@@ -1,6 +1,16 @@
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/DepthFirstIterator.h>
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/ConstantFolding.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Constant.h>
+#include <llvm/IR/ConstantRange.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/Instructions.h>
@@ -8,319 +18,1031 @@
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 using namespace llvm;
 
 namespace {
-class ThePass : public PassInfoMixin<ThePass> {
+
+// Three-level lattice used by the SCCP mode:
+//   Undef (nothing known yet) < Constant < Overdefined (not a constant).
+// A value only ever moves up the lattice, which bounds the solver's work.
+struct LatticeVal {
+  enum Kind { Undef, Const, Overdefined };
+
+  Kind State = Undef;
+  Constant *C = nullptr;
+
+  bool isUndef() const { return State == Undef; }
+  bool isConstant() const { return State == Const; }
+  bool isOverdefined() const { return State == Overdefined; }
+
+  // Return true if the lattice value changed.
+  bool markConstant(Constant *V) {
+    if (isConstant() && C == V)
+      return false;
+    if (isUndef()) {
+      State = Const;
+      C = V;
+      return true;
+    }
+    // two different constants meet at overdefined
+    return markOverdefined();
+  }
+
+  bool markOverdefined() {
+    if (isOverdefined())
+      return false;
+    State = Overdefined;
+    C = nullptr;
+    return true;
+  }
+
+  bool mergeIn(const LatticeVal &Other) {
+    if (Other.isUndef())
+      return false;
+    if (Other.isOverdefined())
+      return markOverdefined();
+    return markConstant(Other.C);
+  }
+};
+
+// Pure intrinsics (llvm.sqrt, llvm.fabs, llvm.smax, ...) and libm functions
+// known to the target library info can be evaluated at compile time.
+// Strict FP calls keep their rounding mode and exception semantics.
+bool isFoldableCall(CallBase *Call) {
+  Function *Callee = Call->getCalledFunction();
+  return Callee && !Call->isStrictFP() && !Call->hasOperandBundles() &&
+         canConstantFoldCallTo(Call, Callee);
+}
+
+// Evaluate a load or a call whose operands are the constants in Ops, or
+// return nullptr. Ops follows the operand order of I.
+Constant *foldMemoryOrCall(Instruction &I, ArrayRef<Constant *> Ops,
+                           const DataLayout &DL, const TargetLibraryInfo *TLI) {
+  // load through a constant address into a `constant` global initializer
+  if (auto *LI = dyn_cast<LoadInst>(&I))
+    return LI->isSimple()
+               ? ConstantFoldLoadFromConstPtr(Ops[0], LI->getType(), DL)
+               : nullptr;
+
+  // ConstantFoldCall refuses inputs that would set errno or raise an FP
+  // exception, so a folded call is always safe to delete
+  if (auto *Call = dyn_cast<CallBase>(&I))
+    return isFoldableCall(Call)
+               ? ConstantFoldCall(Call, Call->getCalledFunction(),
+                                  Ops.take_front(Call->arg_size()), TLI)
+               : nullptr;
+
+  return nullptr;
+}
+
+// Sparse conditional constant propagation (Wegman & Zadeck).
+//
+// Every SSA value starts at Undef and every block starts unreachable. Two
+// worklists drive the solver: the CFG worklist holds blocks that just became
+// executable, the SSA worklist holds instructions whose operands changed.
+// Only edges proven feasible contribute to PHI nodes, so constants guarded by
+// constant branches and constants flowing around loops are found in a single
+// run.
+class SparseConstantSolver {
+private:
+  const DataLayout &DL;
+  const TargetLibraryInfo *TLI;
+
+  DenseMap<Value *, LatticeVal> Values;
+  SmallPtrSet<BasicBlock *, 16> Executable;
+  DenseSet<std::pair<BasicBlock *, BasicBlock *>> FeasibleEdges;
+
+  SmallVector<BasicBlock *, 16> CFGWorklist;
+  SmallVector<Instruction *, 64> SSAWorklist;
+
+  // Notify the users of I that its lattice value moved.
+  void pushUsers(Instruction &I) {
+    for (User *U : I.users())
+      if (auto *UI = dyn_cast<Instruction>(U))
+        if (Executable.count(UI->getParent()))
+          SSAWorklist.push_back(UI);
+  }
+
+  void markConstant(Instruction &I, Constant *C) {
+    if (Values[&I].markConstant(C))
+      pushUsers(I);
+  }
+
+  void markOverdefined(Instruction &I) {
+    if (Values[&I].markOverdefined())
+      pushUsers(I);
+  }
+
+  void mergeIn(Instruction &I, const LatticeVal &LV) {
+    if (Values[&I].mergeIn(LV))
+      pushUsers(I);
+  }
+
+  void markBlockExecutable(BasicBlock *BB) {
+    if (Executable.insert(BB).second)
+      CFGWorklist.push_back(BB);
+  }
+
+  void markEdgeFeasible(BasicBlock *From, BasicBlock *To) {
+    if (!FeasibleEdges.insert({From, To}).second)
+      return;
+    if (!Executable.count(To)) {
+      markBlockExecutable(To);
+      return;
+    }
+    // the block is already live, only its PHIs can observe the new edge
+    for (PHINode &PN : To->phis())
+      SSAWorklist.push_back(&PN);
+  }
+
+  void visitPHINode(PHINode &PN) {
+    if (Values[&PN].isOverdefined())
+      return;
+    LatticeVal Result;
+    for (unsigned i = 0, e = PN.getNumIncomingValues(); i != e; ++i) {
+      if (!FeasibleEdges.count({PN.getIncomingBlock(i), PN.getParent()}))
+        continue;
+      Result.mergeIn(getValue(PN.getIncomingValue(i)));
+      if (Result.isOverdefined())
+        break;
+    }
+    mergeIn(PN, Result);
+  }
+
+  void visitTerminator(Instruction &I) {
+    BasicBlock *BB = I.getParent();
+
+    if (auto *BI = dyn_cast<BranchInst>(&I)) {
+      if (BI->isUnconditional()) {
+        markEdgeFeasible(BB, BI->getSuccessor(0));
+        return;
+      }
+      LatticeVal Cond = getValue(BI->getCondition());
+      if (Cond.isUndef())
+        return;
+      if (auto *CI = dyn_cast_or_null<ConstantInt>(Cond.C)) {
+        markEdgeFeasible(BB, BI->getSuccessor(CI->isZero() ? 1 : 0));
+        return;
+      }
+      markEdgeFeasible(BB, BI->getSuccessor(0));
+      markEdgeFeasible(BB, BI->getSuccessor(1));
+      return;
+    }
+
+    if (auto *SI = dyn_cast<SwitchInst>(&I)) {
+      LatticeVal Cond = getValue(SI->getCondition());
+      if (Cond.isUndef())
+        return;
+      if (auto *CI = dyn_cast_or_null<ConstantInt>(Cond.C)) {
+        markEdgeFeasible(BB, SI->findCaseValue(CI)->getCaseSuccessor());
+        return;
+      }
+    }
+
+    // overdefined switch, invoke, indirectbr, ...: every successor is live
+    for (BasicBlock *Succ : successors(BB))
+      markEdgeFeasible(BB, Succ);
+  }
+
+  void visitSelectInst(SelectInst &SI) {
+    LatticeVal Cond = getValue(SI.getCondition());
+    if (Cond.isUndef())
+      return;
+    if (auto *CI = dyn_cast_or_null<ConstantInt>(Cond.C)) {
+      mergeIn(SI, getValue(CI->isZero() ? SI.getFalseValue()
+                                        : SI.getTrueValue()));
+      return;
+    }
+    // unknown condition: the result is constant only if both arms agree
+    LatticeVal Result = getValue(SI.getTrueValue());
+    Result.mergeIn(getValue(SI.getFalseValue()));
+    mergeIn(SI, Result);
+  }
+
+  void visitInstruction(Instruction &I) {
+    if (isa<PHINode>(I))
+      return visitPHINode(cast<PHINode>(I));
+    if (I.isTerminator()) {
+      // the result of an invoke or callbr is not known
+      if (!I.getType()->isVoidTy())
+        markOverdefined(I);
+      return visitTerminator(I);
+    }
+    if (I.getType()->isVoidTy())
+      return;
+    if (Values[&I].isOverdefined())
+      return;
+
+    // anything else touching memory or with side effects is not a constant
+    bool MemoryOrCall = isa<LoadInst>(I) ||
+                        (isa<CallInst>(I) && isFoldableCall(cast<CallInst>(&I)));
+    if (!MemoryOrCall &&
+        (I.mayReadOrWriteMemory() || I.mayHaveSideEffects() ||
+         isa<CallBase, AllocaInst, LandingPadInst>(I)))
+      return markOverdefined(I);
+
+    if (auto *SI = dyn_cast<SelectInst>(&I))
+      return visitSelectInst(*SI);
+
+    SmallVector<Constant *, 4> Ops;
+    for (Value *Op : I.operands()) {
+      LatticeVal LV = getValue(Op);
+      if (LV.isOverdefined())
+        return markOverdefined(I);
+      if (LV.isUndef())
+        return; // wait until the operand is resolved
+      Ops.push_back(LV.C);
+    }
+
+    Constant *C;
+    if (MemoryOrCall)
+      C = foldMemoryOrCall(I, Ops, DL, TLI);
+    else if (auto *CI = dyn_cast<CmpInst>(&I))
+      C = ConstantFoldCompareInstOperands(CI->getPredicate(), Ops[0], Ops[1],
+                                          DL, TLI);
+    else
+      C = ConstantFoldInstOperands(&I, Ops, DL, TLI);
+    if (C)
+      markConstant(I, C);
+    else
+      markOverdefined(I);
+  }
+
 public:
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-    bool Changed = false;
-    Module *M = F.getParent();
-    const DataLayout &DL = M->getDataLayout();
+  SparseConstantSolver(const DataLayout &DL, const TargetLibraryInfo *TLI)
+      : DL(DL), TLI(TLI) {}
+
+  LatticeVal getValue(Value *V) {
+    LatticeVal LV;
+    if (auto *C = dyn_cast<Constant>(V))
+      LV.markConstant(C);
+    else if (auto *I = dyn_cast<Instruction>(V))
+      LV = Values.lookup(I);
+    else
+      LV.markOverdefined(); // arguments, inline asm, ...
+    return LV;
+  }
+
+  bool isExecutable(BasicBlock *BB) const { return Executable.count(BB); }
+
+  void solve(Function &F) {
+    markBlockExecutable(&F.getEntryBlock());
+
+    while (!CFGWorklist.empty() || !SSAWorklist.empty()) {
+      // drain the SSA worklist first, it is usually the cheaper one
+      while (!SSAWorklist.empty()) {
+        Instruction *I = SSAWorklist.pop_back_val();
+        if (Executable.count(I->getParent()))
+          visitInstruction(*I);
+      }
+      while (!CFGWorklist.empty()) {
+        BasicBlock *BB = CFGWorklist.pop_back_val();
+        for (Instruction &I : *BB)
+          visitInstruction(I);
+      }
+    }
+  }
+};
 
+// Algebraic identities for binary operators, as a rule table keyed by opcode.
+//
+// Operands are classified once per instruction into a bit mask, and only the
+// rules registered for the instruction's opcode are tried, so adding a rule
+// costs nothing on unrelated opcodes.
+enum OperandClass : unsigned {
+  OC_Zero = 1 << 0,    // 0 or 0.0
+  OC_One = 1 << 1,     // 1 or 1.0
+  OC_AllOnes = 1 << 2, // -1 (integers only)
+};
+
+enum class RuleResult {
+  Other,   // the operand the pattern did not match
+  Matched, // the constant the pattern matched
+  Zero,    // null value of the instruction type
+};
+
+struct IdentityRule {
+  unsigned Opcode;
+  // bit mask of OperandClass the constant operand must have; 0 means the
+  // rule matches `x op x` instead
+  unsigned Pattern;
+  // operand index the pattern is checked on
+  unsigned Operand;
+  // also try the pattern on the other operand
+  bool Commutative;
+  RuleResult Result;
+};
+
+// Rules must stay grouped by opcode, see isGroupedByOpcode() below.
+constexpr IdentityRule IdentityRules[] = {
+    // x + 0 => x, 0 + x => x
+    {Instruction::Add, OC_Zero, 1, true, RuleResult::Other},
+    {Instruction::FAdd, OC_Zero, 1, true, RuleResult::Other},
+    // x - 0 => x, x - x => 0
+    {Instruction::Sub, OC_Zero, 1, false, RuleResult::Other},
+    {Instruction::Sub, 0, 0, false, RuleResult::Zero},
+    {Instruction::FSub, OC_Zero, 1, false, RuleResult::Other},
+    {Instruction::FSub, 0, 0, false, RuleResult::Zero},
+    // x * 1 => x, 1 * x => x, x * 0 => 0, 0 * x => 0
+    {Instruction::Mul, OC_One, 1, true, RuleResult::Other},
+    {Instruction::Mul, OC_Zero, 1, true, RuleResult::Matched},
+    {Instruction::FMul, OC_One, 1, true, RuleResult::Other},
+    {Instruction::FMul, OC_Zero, 1, true, RuleResult::Matched},
+    // x / 1 => x
+    {Instruction::UDiv, OC_One, 1, false, RuleResult::Other},
+    {Instruction::SDiv, OC_One, 1, false, RuleResult::Other},
+    {Instruction::FDiv, OC_One, 1, false, RuleResult::Other},
+    // x << 0 => x, 0 << x => 0, same for right shifts
+    {Instruction::Shl, OC_Zero, 1, false, RuleResult::Other},
+    {Instruction::Shl, OC_Zero, 0, false, RuleResult::Matched},
+    {Instruction::LShr, OC_Zero, 1, false, RuleResult::Other},
+    {Instruction::LShr, OC_Zero, 0, false, RuleResult::Matched},
+    {Instruction::AShr, OC_Zero, 1, false, RuleResult::Other},
+    {Instruction::AShr, OC_Zero, 0, false, RuleResult::Matched},
+    // x & 0 => 0, x & -1 => x, x & x => x
+    {Instruction::And, OC_Zero, 1, true, RuleResult::Matched},
+    {Instruction::And, OC_AllOnes, 1, true, RuleResult::Other},
+    {Instruction::And, 0, 0, false, RuleResult::Other},
+    // x | 0 => x, x | -1 => -1, x | x => x
+    {Instruction::Or, OC_Zero, 1, true, RuleResult::Other},
+    {Instruction::Or, OC_AllOnes, 1, true, RuleResult::Matched},
+    {Instruction::Or, 0, 0, false, RuleResult::Other},
+    // x ^ 0 => x, x ^ x => 0
+    {Instruction::Xor, OC_Zero, 1, true, RuleResult::Other},
+    {Instruction::Xor, 0, 0, false, RuleResult::Zero},
+};
+
+constexpr unsigned NumIdentityRules =
+    sizeof(IdentityRules) / sizeof(IdentityRules[0]);
+constexpr unsigned NumBinaryOps =
+    Instruction::BinaryOpsEnd - Instruction::BinaryOpsBegin;
+
+constexpr bool isGroupedByOpcode() {
+  for (unsigned i = 0; i < NumIdentityRules; ++i)
+    for (unsigned j = i + 1; j < NumIdentityRules; ++j)
+      if (IdentityRules[j].Opcode == IdentityRules[i].Opcode &&
+          IdentityRules[j - 1].Opcode != IdentityRules[i].Opcode)
+        return false;
+  return true;
+}
+static_assert(isGroupedByOpcode(), "identity rules must be grouped by opcode");
+
+// [Begin, End) slice of IdentityRules for every binary opcode.
+struct RuleIndex {
+  struct {
+    unsigned Begin = 0, End = 0;
+  } Ranges[NumBinaryOps];
+};
+
+constexpr RuleIndex buildRuleIndex() {
+  RuleIndex Idx{};
+  for (unsigned i = 0; i < NumIdentityRules; ++i) {
+    auto &R = Idx.Ranges[IdentityRules[i].Opcode - Instruction::BinaryOpsBegin];
+    if (R.Begin == R.End)
+      R.Begin = i;
+    R.End = i + 1;
+  }
+  return Idx;
+}
+
+constexpr RuleIndex IdentityRuleIndex = buildRuleIndex();
+
+// Literal constants the folder evaluates; vectors are folded lane-wise.
+bool isFoldableConstant(Value *V) {
+  return isa<ConstantInt, ConstantFP, ConstantDataVector, ConstantVector,
+             ConstantAggregateZero>(V);
+}
+
+unsigned classifyOperand(Value *V) {
+  // a vector is classified by its splat lane, so every rule applies lane-wise
+  if (V->getType()->isVectorTy()) {
+    auto *C = dyn_cast<Constant>(V);
+    if (!C)
+      return 0;
+    V = C->getSplatValue();
+    if (!V)
+      return 0;
+  }
+
+  if (auto *CI = dyn_cast<ConstantInt>(V)) {
+    unsigned Class = 0;
+    if (CI->isZero())
+      Class |= OC_Zero;
+    if (CI->isOne())
+      Class |= OC_One;
+    if (CI->isMinusOne())
+      Class |= OC_AllOnes;
+    return Class;
+  }
+  if (auto *CF = dyn_cast<ConstantFP>(V)) {
+    if (CF->isZeroValue())
+      return OC_Zero;
+    if (CF->isExactlyValue(1.0))
+      return OC_One;
+  }
+  return 0;
+}
+
+// Return the value BO simplifies to, or nullptr.
+Value *simplifyBinaryOperator(BinaryOperator *BO, const DataLayout &DL) {
+  Value *Ops[2] = {BO->getOperand(0), BO->getOperand(1)};
+
+  // both operands constant: fold the whole instruction
+  if (isFoldableConstant(Ops[0]) && isFoldableConstant(Ops[1]))
+    return ConstantFoldBinaryOpOperands(BO->getOpcode(), cast<Constant>(Ops[0]),
+                                        cast<Constant>(Ops[1]), DL);
+
+  auto &Range =
+      IdentityRuleIndex.Ranges[BO->getOpcode() - Instruction::BinaryOpsBegin];
+  if (Range.Begin == Range.End)
+    return nullptr;
+
+  unsigned Classes[2] = {classifyOperand(Ops[0]), classifyOperand(Ops[1])};
+
+  for (unsigned i = Range.Begin; i != Range.End; ++i) {
+    const IdentityRule &R = IdentityRules[i];
+
+    if (R.Pattern == 0) {
+      if (Ops[0] != Ops[1])
+        continue;
+      return R.Result == RuleResult::Zero ? Constant::getNullValue(BO->getType())
+                                          : Ops[0];
+    }
+
+    unsigned Matched = R.Operand;
+    if (!(Classes[Matched] & R.Pattern)) {
+      if (!R.Commutative || !(Classes[1 - Matched] & R.Pattern))
+        continue;
+      Matched = 1 - Matched;
+    }
+
+    switch (R.Result) {
+    case RuleResult::Other:
+      return Ops[1 - Matched];
+    case RuleResult::Matched:
+      return Ops[Matched];
+    case RuleResult::Zero:
+      return Constant::getNullValue(BO->getType());
+    }
+  }
+  return nullptr;
+}
+
+// Return the value a vector element or aggregate member access simplifies to,
+// or nullptr.
+Value *simplifyVectorOrAggregate(Instruction &I, const DataLayout &DL) {
+  // every operand is a constant: evaluate the access
+  SmallVector<Constant *, 3> Ops;
+  for (Value *Op : I.operands()) {
+    auto *C = dyn_cast<Constant>(Op);
+    if (!C || isa<ConstantExpr, GlobalValue>(C))
+      break;
+    Ops.push_back(C);
+  }
+  if (Ops.size() == I.getNumOperands())
+    if (Constant *C = ConstantFoldInstOperands(&I, Ops, DL))
+      return C;
+
+  // extractelement (insertelement v, x, i), i => x, looking through inserts
+  // into other constant lanes
+  if (auto *EE = dyn_cast<ExtractElementInst>(&I)) {
+    auto *Idx = dyn_cast<ConstantInt>(EE->getIndexOperand());
+    if (!Idx)
+      return nullptr;
+    Value *Vec = EE->getVectorOperand();
+    while (auto *IE = dyn_cast<InsertElementInst>(Vec)) {
+      auto *InsIdx = dyn_cast<ConstantInt>(IE->getOperand(2));
+      if (!InsIdx)
+        return nullptr;
+      if (APInt::isSameValue(InsIdx->getValue(), Idx->getValue()))
+        return IE->getOperand(1);
+      Vec = IE->getOperand(0);
+    }
+    if (auto *C = dyn_cast<Constant>(Vec))
+      if (!isa<ConstantExpr>(C))
+        return C->getAggregateElement(Idx);
+    return nullptr;
+  }
+
+  // extractvalue (insertvalue a, x, idx), idx => x, looking through inserts
+  // into unrelated members
+  if (auto *EV = dyn_cast<ExtractValueInst>(&I)) {
+    ArrayRef<unsigned> Indices = EV->getIndices();
+    Value *Agg = EV->getAggregateOperand();
+    while (auto *IV = dyn_cast<InsertValueInst>(Agg)) {
+      ArrayRef<unsigned> InsIndices = IV->getIndices();
+      if (InsIndices == Indices)
+        return IV->getInsertedValueOperand();
+      // one path is a prefix of the other: the members overlap
+      size_t Common = std::min(Indices.size(), InsIndices.size());
+      if (Indices.take_front(Common) == InsIndices.take_front(Common))
+        return nullptr;
+      Agg = IV->getAggregateOperand();
+    }
+    auto *C = dyn_cast<Constant>(Agg);
+    for (unsigned Idx : Indices) {
+      if (!C || isa<ConstantExpr>(C))
+        return nullptr;
+      C = C->getAggregateElement(Idx);
+    }
+    return C;
+  }
+
+  // shufflevector v, w, <0, 1, ..., n-1> => v, undef lanes allowed
+  // shufflevector v, w, <n, n+1, ..., 2n-1> => w
+  if (auto *SV = dyn_cast<ShuffleVectorInst>(&I)) {
+    auto *OpTy = dyn_cast<FixedVectorType>(SV->getOperand(0)->getType());
+    if (!OpTy || !SV->isIdentity())
+      return nullptr;
+    int NumElts = OpTy->getNumElements();
+    ArrayRef<int> Mask = SV->getShuffleMask();
+    if (all_of(Mask, [&](int M) { return M < NumElts; }))
+      return SV->getOperand(0);
+    bool FromSecond = true;
+    for (int Idx = 0, E = Mask.size(); Idx != E; ++Idx)
+      FromSecond &= Mask[Idx] == NumElts + Idx;
+    if (FromSecond)
+      return SV->getOperand(1);
+  }
+
+  return nullptr;
+}
+
+// Return the value I simplifies to, or nullptr.
+Value *simplifyInstruction(Instruction &I, const DataLayout &DL,
+                          const TargetLibraryInfo *TLI) {
+  // Handle binary operations
+  if (auto *BO = dyn_cast<BinaryOperator>(&I))
+    return simplifyBinaryOperator(BO, DL);
+
+  // compare two constants, lane-wise for vectors
+  if (auto *CI = dyn_cast<CmpInst>(&I))
+    if (isFoldableConstant(CI->getOperand(0)) &&
+        isFoldableConstant(CI->getOperand(1)))
+      return ConstantFoldCompareInstOperands(
+          CI->getPredicate(), cast<Constant>(CI->getOperand(0)),
+          cast<Constant>(CI->getOperand(1)), DL);
+
+  if (auto *IC = dyn_cast<ICmpInst>(&I)) {
+    if (IC->getOperand(0) != IC->getOperand(1))
+      return nullptr;
+    // Compare with self
+    bool Result;
+    switch (IC->getPredicate()) {
+    case ICmpInst::ICMP_EQ:  // x == x => true
+    case ICmpInst::ICMP_ULE: // x <= x => true (unsigned)
+    case ICmpInst::ICMP_SLE: // x <= x => true (signed)
+    case ICmpInst::ICMP_UGE: // x >= x => true (unsigned)
+    case ICmpInst::ICMP_SGE: // x >= x => true (signed)
+      Result = true;
+      break;
+    default:
+      Result = false;
+    }
+    return ConstantInt::get(IC->getType(), Result);
+  }
+
+  // Handle floating-point comparison instructions
+  if (auto *FC = dyn_cast<FCmpInst>(&I)) {
+    if (FC->getOperand(0) != FC->getOperand(1))
+      return nullptr;
+    // Compare with self (assuming no NaN)
+    bool Result;
+    switch (FC->getPredicate()) {
+    case FCmpInst::FCMP_OEQ: // ordered equal: x == x => true
+    case FCmpInst::FCMP_OLE: // ordered <=: x <= x => true
+    case FCmpInst::FCMP_OGE: // ordered >=: x >= x => true
+    case FCmpInst::FCMP_UEQ: // unordered equal: x == x => true
+    case FCmpInst::FCMP_ULE: // unordered <=: x <= x => true
+    case FCmpInst::FCMP_UGE: // unordered >=: x >= x => true
+      Result = true;
+      break;
+    case FCmpInst::FCMP_ONE: // ordered !=: x != x => false
+    case FCmpInst::FCMP_OLT: // ordered <: x < x => false
+    case FCmpInst::FCMP_OGT: // ordered >: x > x => false
+    case FCmpInst::FCMP_ULT: // unordered <: x < x => false
+    case FCmpInst::FCMP_UGT: // unordered >: x > x => false
+      Result = false;
+      break;
+    // skip NaN-related predicates
+    case FCmpInst::FCMP_UNE: // unordered !=: could be true if NaN
+    case FCmpInst::FCMP_ORD: // ordered (not NaN): may be false if NaN
+    case FCmpInst::FCMP_UNO: // unordered (is NaN): may be true if NaN
+    default:
+      return nullptr;
+    }
+    return ConstantInt::get(FC->getType(), Result);
+  }
+
+  // phi [x, a], [x, b], ... => x
+  if (auto *PN = dyn_cast<PHINode>(&I)) {
+    Value *Common = nullptr;
+    for (Value *In : PN->incoming_values()) {
+      if (In == PN)
+        continue;
+      if (Common && In != Common)
+        return nullptr;
+      Common = In;
+    }
+    return Common;
+  }
+
+  // Handle select instructions
+  if (auto *SI = dyn_cast<SelectInst>(&I)) {
+    Value *Cond = SI->getCondition();
+    // a splat vector condition selects whole operands
+    if (Cond->getType()->isVectorTy())
+      if (auto *C = dyn_cast<Constant>(Cond))
+        if (Constant *Splat = C->getSplatValue())
+          Cond = Splat;
+    // select true, x, y => x
+    // select false, x, y => y
+    if (auto *ConstCond = dyn_cast<ConstantInt>(Cond))
+      return ConstCond->isOne() ? SI->getTrueValue() : SI->getFalseValue();
+    // select <c0, c1, ...>, C1, C2 => lane-wise constant
+    if (isFoldableConstant(Cond) && isFoldableConstant(SI->getTrueValue()) &&
+        isFoldableConstant(SI->getFalseValue())) {
+      Constant *Ops[] = {cast<Constant>(Cond),
+                         cast<Constant>(SI->getTrueValue()),
+                         cast<Constant>(SI->getFalseValue())};
+      return ConstantFoldInstOperands(SI, Ops, DL);
+    }
+    // select cond, x, x => x
+    if (SI->getTrueValue() == SI->getFalseValue())
+      return SI->getTrueValue();
+  }
+
+  // Handle casts, address computations, constant-global loads and pure calls
+  // whose operands are all constants
+  if (isa<CastInst, GetElementPtrInst, LoadInst>(&I) ||
+      (isa<CallInst>(&I) && isFoldableCall(cast<CallInst>(&I)))) {
+    SmallVector<Constant *, 4> Ops;
+    for (Value *Op : I.operands()) {
+      auto *C = dyn_cast<Constant>(Op);
+      if (!C)
+        return nullptr;
+      Ops.push_back(C);
+    }
+    if (isa<LoadInst, CallInst>(&I))
+      return foldMemoryOrCall(I, Ops, DL, TLI);
+    return ConstantFoldInstOperands(&I, Ops, DL, TLI);
+  }
+
+  // Handle vector element and aggregate member accesses
+  if (isa<ExtractElementInst, InsertElementInst, ShuffleVectorInst,
+          ExtractValueInst, InsertValueInst>(&I))
+    return simplifyVectorOrAggregate(I, DL);
+
+  return nullptr;
+}
+
+// Return the only successor a constant conditional branch or switch can take,
+// or nullptr if the terminator is not foldable.
+BasicBlock *getConstantSuccessor(Instruction &Term) {
+  if (auto *BI = dyn_cast<BranchInst>(&Term)) {
+    if (BI->isUnconditional())
+      return nullptr;
+    // br i1 %c, label %a, label %a => br label %a
+    if (BI->getSuccessor(0) == BI->getSuccessor(1))
+      return BI->getSuccessor(0);
+    if (auto *Cond = dyn_cast<ConstantInt>(BI->getCondition()))
+      return BI->getSuccessor(Cond->isZero() ? 1 : 0);
+    return nullptr;
+  }
+  if (auto *SI = dyn_cast<SwitchInst>(&Term)) {
+    if (auto *Cond = dyn_cast<ConstantInt>(SI->getCondition()))
+      return SI->findCaseValue(Cond)->getCaseSuccessor();
+    if (SI->getNumCases() == 0)
+      return SI->getDefaultDest();
+  }
+  return nullptr;
+}
+
+// Turn Term into an unconditional branch to Dest. The PHIs of every block
+// that loses an edge are kept (even with one input left) and reported
+// through Lost, so the caller can revisit them.
+void foldTerminator(Instruction &Term, BasicBlock *Dest,
+                    SmallVectorImpl<BasicBlock *> &Lost) {
+  BasicBlock *BB = Term.getParent();
+  bool KeptDest = false;
+  for (BasicBlock *Succ : successors(BB)) {
+    // one edge to Dest survives, every other edge goes away, including
+    // duplicate switch edges to Dest
+    if (Succ == Dest && !KeptDest) {
+      KeptDest = true;
+      continue;
+    }
+    Succ->removePredecessor(BB, /*KeepOneInputPHIs=*/true);
+    Lost.push_back(Succ);
+  }
+  Term.eraseFromParent();
+  BranchInst::Create(Dest, BB);
+}
+
+// Integer value-range analysis on the ConstantRange lattice.
+//
+// Every integer instruction gets the range of its definition in one reverse
+// post-order sweep: constants, and/lshr/urem masks, zext/sext/trunc and the
+// arithmetic ConstantRange can evaluate. PHIs take the union of their
+// incoming values; incoming values not computed yet (loop back edges) are
+// pessimistically the full set, so one sweep is enough. At a use, the range
+// is further narrowed by the branch conditions that dominate it.
+class RangeAnalysis {
+private:
+  DominatorTree &DT;
+  DenseMap<Value *, ConstantRange> Ranges;
+
+  ConstantRange computeRange(Instruction &I) {
+    unsigned BitWidth = I.getType()->getIntegerBitWidth();
+
+    if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+      ConstantRange L = getRange(BO->getOperand(0));
+      ConstantRange R = getRange(BO->getOperand(1));
+      if (auto *OBO = dyn_cast<OverflowingBinaryOperator>(BO)) {
+        unsigned NoWrap = 0;
+        if (OBO->hasNoSignedWrap())
+          NoWrap |= OverflowingBinaryOperator::NoSignedWrap;
+        if (OBO->hasNoUnsignedWrap())
+          NoWrap |= OverflowingBinaryOperator::NoUnsignedWrap;
+        if (NoWrap)
+          return L.overflowingBinaryOp(BO->getOpcode(), R, NoWrap);
+      }
+      return L.binaryOp(BO->getOpcode(), R);
+    }
+
+    if (auto *CI = dyn_cast<CastInst>(&I))
+      if (CI->getSrcTy()->isIntegerTy())
+        return getRange(CI->getOperand(0)).castOp(CI->getOpcode(), BitWidth);
+
+    if (auto *SI = dyn_cast<SelectInst>(&I))
+      return getRange(SI->getTrueValue())
+          .unionWith(getRange(SI->getFalseValue()));
+
+    if (auto *PN = dyn_cast<PHINode>(&I)) {
+      ConstantRange Result = ConstantRange::getEmpty(BitWidth);
+      for (Value *In : PN->incoming_values())
+        Result = Result.unionWith(getRange(In));
+      return Result;
+    }
+
+    return ConstantRange::getFull(BitWidth);
+  }
+
+public:
+  explicit RangeAnalysis(DominatorTree &DT) : DT(DT) {}
+
+  void compute(Function &F) {
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    for (BasicBlock *BB : RPOT)
+      for (Instruction &I : *BB)
+        if (I.getType()->isIntegerTy())
+          Ranges.insert({&I, computeRange(I)});
+  }
+
+  // Range of V's definition.
+  ConstantRange getRange(Value *V) {
+    unsigned BitWidth = V->getType()->getIntegerBitWidth();
+    if (auto *C = dyn_cast<ConstantInt>(V))
+      return ConstantRange(C->getValue());
+    auto It = Ranges.find(V);
+    if (It != Ranges.end())
+      return It->second;
+    return ConstantRange::getFull(BitWidth);
+  }
+
+  // Range of V at CtxI: the definition range narrowed by every
+  // `br (icmp pred V, X)` whose taken edge dominates CtxI.
+  ConstantRange getRangeAt(Value *V, Instruction *CtxI) {
+    ConstantRange Result = getRange(V);
+    if (isa<Constant>(V))
+      return Result;
+
+    BasicBlock *BB = CtxI->getParent();
+    for (DomTreeNode *N = DT.getNode(BB); N; N = N->getIDom()) {
+      auto *BI = dyn_cast<BranchInst>(N->getBlock()->getTerminator());
+      if (!BI || BI->isUnconditional() ||
+          BI->getSuccessor(0) == BI->getSuccessor(1))
+        continue;
+      auto *Cmp = dyn_cast<ICmpInst>(BI->getCondition());
+      if (!Cmp)
+        continue;
+
+      ICmpInst::Predicate Pred = Cmp->getPredicate();
+      Value *Other;
+      if (Cmp->getOperand(0) == V) {
+        Other = Cmp->getOperand(1);
+      } else if (Cmp->getOperand(1) == V) {
+        Other = Cmp->getOperand(0);
+        Pred = ICmpInst::getSwappedPredicate(Pred);
+      } else {
+        continue;
+      }
+
+      for (unsigned S = 0; S != 2; ++S) {
+        BasicBlockEdge Edge(N->getBlock(), BI->getSuccessor(S));
+        if (!DT.dominates(Edge, BB))
+          continue;
+        ICmpInst::Predicate EdgePred =
+            S == 0 ? Pred : ICmpInst::getInversePredicate(Pred);
+        Result = Result.intersectWith(
+            ConstantRange::makeAllowedICmpRegion(EdgePred, getRange(Other)));
+      }
+    }
+    return Result;
+  }
+};
+
+// Options of the function pass, spelled ConstantPropagation<sccp;range>.
+struct ConstantPropagationOptions {
+  bool SCCP = false;
+  bool Ranges = false;
+};
+
+class ThePass : public PassInfoMixin<ThePass> {
+private:
+  ConstantPropagationOptions Opts;
+
+  // Fold the icmps the range analysis decides, and mark add/sub/mul/shl
+  // nsw/nuw where the operand ranges prove the operation cannot wrap.
+  bool runRanges(Function &F, FunctionAnalysisManager &AM) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    RangeAnalysis RA(DT);
+    RA.compute(F);
+
+    bool Changed = false;
     for (BasicBlock &BB : F) {
       for (auto It = BB.begin(); It != BB.end();) {
         Instruction &I = *It++;
-        // Handle binary operations
-        if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
-          Value *Op0 = BO->getOperand(0);
-          Value *Op1 = BO->getOperand(1);
-          if (isa<ConstantInt, ConstantFP>(Op0) &&
-              isa<ConstantInt, ConstantFP>(Op1)) {
-            Constant *C0 = cast<Constant>(Op0);
-            Constant *C1 = cast<Constant>(Op1);
-            if (Constant *Folded = ConstantExpr::get(BO->getOpcode(), C0, C1)) {
-              BO->replaceAllUsesWith(Folded);
-              BO->eraseFromParent();
-              Changed = true;
-            }
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isOne()) &&
-                     BO->getOpcode() == Instruction::Mul) {
-            // 1 * x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantFP>(Op0) &&
-                      cast<ConstantFP>(Op0)->isExactlyValue(1.0)) &&
-                     BO->getOpcode() == Instruction::FMul) {
-            // 1.0 * x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isOne()) &&
-                     BO->getOpcode() == Instruction::Mul) {
-            // x * 1 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantFP>(Op1) &&
-                      cast<ConstantFP>(Op1)->isExactlyValue(1.0)) &&
-                     BO->getOpcode() == Instruction::FMul) {
-            // x * 1.0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isOne()) &&
-                     (BO->getOpcode() == Instruction::SDiv ||
-                      BO->getOpcode() == Instruction::UDiv)) {
-            // x / 1 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantFP>(Op1) &&
-                      cast<ConstantFP>(Op1)->isExactlyValue(1.0)) &&
-                     BO->getOpcode() == Instruction::FDiv) {
-            // x / 1.0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt, ConstantFP>(Op0) &&
-                      cast<Constant>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Add ||
-                      BO->getOpcode() == Instruction::FAdd)) {
-            // 0 + x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt, ConstantFP>(Op1) &&
-                      cast<Constant>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Add ||
-                      BO->getOpcode() == Instruction::FAdd)) {
-            // x + 0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt, ConstantFP>(Op1) &&
-                      cast<Constant>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Sub ||
-                      BO->getOpcode() == Instruction::FSub)) {
-            // x - 0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt, ConstantFP>(Op0) &&
-                      cast<Constant>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Mul ||
-                      BO->getOpcode() == Instruction::FMul)) {
-            // 0 * x => 0
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt, ConstantFP>(Op1) &&
-                      cast<Constant>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Mul ||
-                      BO->getOpcode() == Instruction::FMul)) {
-            // x * 0 => 0
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::And)) {
-            // x & 0 => 0
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::And)) {
-            // 0 & x => 0
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isAllOnesValue()) &&
-                     (BO->getOpcode() == Instruction::And)) {
-            // x & -1 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isAllOnesValue()) &&
-                     (BO->getOpcode() == Instruction::And)) {
-            // -1 & x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Or)) {
-            // x | 0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Or)) {
-            // 0 | x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isAllOnesValue()) &&
-                     (BO->getOpcode() == Instruction::Or)) {
-            // x | -1 => -1
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isAllOnesValue()) &&
-                     (BO->getOpcode() == Instruction::Or)) {
-            // -1 | x => -1
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Xor)) {
-            // x ^ 0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Xor)) {
-            // 0 ^ x => x
-            BO->replaceAllUsesWith(Op1);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if (Op0 == Op1 && BO->getOpcode() == Instruction::Xor) {
-            // x ^ x => 0
-            Constant *Zero = ConstantInt::get(BO->getType(), 0);
-            BO->replaceAllUsesWith(Zero);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if (Op0 == Op1 && (BO->getOpcode() == Instruction::Sub ||
-                                    BO->getOpcode() == Instruction::FSub)) {
-            // x - x => 0
-            Constant *Zero;
-            if (BO->getType()->isIntegerTy()) {
-              Zero = ConstantInt::get(BO->getType(), 0);
-            } else {
-              Zero = ConstantFP::get(BO->getType(), 0.0);
-            }
-            BO->replaceAllUsesWith(Zero);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op1) &&
-                      cast<ConstantInt>(Op1)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Shl ||
-                      BO->getOpcode() == Instruction::LShr ||
-                      BO->getOpcode() == Instruction::AShr)) {
-            // x << 0 => x, x >> 0 => x
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if ((isa<ConstantInt>(Op0) &&
-                      cast<ConstantInt>(Op0)->isZeroValue()) &&
-                     (BO->getOpcode() == Instruction::Shl ||
-                      BO->getOpcode() == Instruction::LShr ||
-                      BO->getOpcode() == Instruction::AShr)) {
-            // 0 << x => 0, 0 >> x => 0
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if (Op0 == Op1 && BO->getOpcode() == Instruction::And) {
-            // x & x => x (idempotent)
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          } else if (Op0 == Op1 && BO->getOpcode() == Instruction::Or) {
-            // x | x => x (idempotent)
-            BO->replaceAllUsesWith(Op0);
-            BO->eraseFromParent();
-            Changed = true;
-          }
-        }
 
-        if (auto *IC = dyn_cast<ICmpInst>(&I)) {
-          Value *Op0 = IC->getOperand(0);
-          Value *Op1 = IC->getOperand(1);
-
-          if (Op0 == Op1) {
-            // Compare with self
-            bool Result;
-            switch (IC->getPredicate()) {
-            case ICmpInst::ICMP_EQ:  // x == x => true
-            case ICmpInst::ICMP_ULE: // x <= x => true (unsigned)
-            case ICmpInst::ICMP_SLE: // x <= x => true (signed)
-            case ICmpInst::ICMP_UGE: // x >= x => true (unsigned)
-            case ICmpInst::ICMP_SGE: // x >= x => true (signed)
-              Result = true;
-              break;
-            default:
-              Result = false;
-            }
-            Constant *ResultConst = ConstantInt::get(IC->getType(), Result);
-            IC->replaceAllUsesWith(ResultConst);
-            IC->eraseFromParent();
-            Changed = true;
-          }
+        if (auto *Cmp = dyn_cast<ICmpInst>(&I)) {
+          if (!Cmp->getOperand(0)->getType()->isIntegerTy())
+            continue;
+          ConstantRange L = RA.getRangeAt(Cmp->getOperand(0), Cmp);
+          ConstantRange R = RA.getRangeAt(Cmp->getOperand(1), Cmp);
+          ICmpInst::Predicate Pred = Cmp->getPredicate();
+          Constant *Result = nullptr;
+          if (L.icmp(Pred, R))
+            Result = ConstantInt::getTrue(Cmp->getType());
+          else if (L.icmp(ICmpInst::getInversePredicate(Pred), R))
+            Result = ConstantInt::getFalse(Cmp->getType());
+          if (!Result)
+            continue;
+          errs() << "Ranges: folding " << *Cmp << "\n";
+          Cmp->replaceAllUsesWith(Result);
+          Cmp->eraseFromParent();
+          Changed = true;
+          continue;
         }
 
-        // Handle floating-point comparison instructions
-        if (auto *FC = dyn_cast<FCmpInst>(&I)) {
-          Value *Op0 = FC->getOperand(0);
-          Value *Op1 = FC->getOperand(1);
-
-          if (Op0 == Op1) {
-            // Compare with self (assuming no NaN)
-            bool Result;
-            switch (FC->getPredicate()) {
-            case FCmpInst::FCMP_OEQ: // ordered equal: x == x => true
-            case FCmpInst::FCMP_OLE: // ordered <=: x <= x => true
-            case FCmpInst::FCMP_OGE: // ordered >=: x >= x => true
-            case FCmpInst::FCMP_UEQ: // unordered equal: x == x => true
-            case FCmpInst::FCMP_ULE: // unordered <=: x <= x => true
-            case FCmpInst::FCMP_UGE: // unordered >=: x >= x => true
-              Result = true;
-              break;
-            case FCmpInst::FCMP_ONE: // ordered !=: x != x => false
-            case FCmpInst::FCMP_OLT: // ordered <: x < x => false
-            case FCmpInst::FCMP_OGT: // ordered >: x > x => false
-            case FCmpInst::FCMP_ULT: // unordered <: x < x => false
-            case FCmpInst::FCMP_UGT: // unordered >: x > x => false
-              Result = false;
-              break;
-            // skip NaN-related predicates
-            case FCmpInst::FCMP_UNE: // unordered !=: could be true if NaN
-            case FCmpInst::FCMP_ORD: // ordered (not NaN): may be false if NaN
-            case FCmpInst::FCMP_UNO: // unordered (is NaN): may be true if NaN
-            default:
-              continue;
-            }
-            Constant *ResultConst = ConstantInt::get(FC->getType(), Result);
-            FC->replaceAllUsesWith(ResultConst);
-            FC->eraseFromParent();
-            Changed = true;
-          }
+        auto *BO = dyn_cast<BinaryOperator>(&I);
+        if (!BO || !isa<OverflowingBinaryOperator>(BO) ||
+            !BO->getType()->isIntegerTy())
+          continue;
+        ConstantRange L = RA.getRangeAt(BO->getOperand(0), BO);
+        ConstantRange R = RA.getRangeAt(BO->getOperand(1), BO);
+        if (!BO->hasNoSignedWrap() &&
+            ConstantRange::makeGuaranteedNoWrapRegion(
+                BO->getOpcode(), R, OverflowingBinaryOperator::NoSignedWrap)
+                .contains(L)) {
+          BO->setHasNoSignedWrap(true);
+          Changed = true;
         }
+        if (!BO->hasNoUnsignedWrap() &&
+            ConstantRange::makeGuaranteedNoWrapRegion(
+                BO->getOpcode(), R, OverflowingBinaryOperator::NoUnsignedWrap)
+                .contains(L)) {
+          BO->setHasNoUnsignedWrap(true);
+          Changed = true;
+        }
+      }
+    }
+    return Changed;
+  }
 
-        // Handle select instructions
-        if (auto *SI = dyn_cast<SelectInst>(&I)) {
-          Value *Cond = SI->getCondition();
-          Value *TrueVal = SI->getTrueValue();
-          Value *FalseVal = SI->getFalseValue();
-
-          if (auto *ConstCond = dyn_cast<ConstantInt>(Cond)) {
-            // select true, x, y => x
-            // select false, x, y => y
-            Value *Result = ConstCond->isOne() ? TrueVal : FalseVal;
-            SI->replaceAllUsesWith(Result);
-            SI->eraseFromParent();
-            Changed = true;
-          } else if (TrueVal == FalseVal) {
-            // select cond, x, x => x
-            SI->replaceAllUsesWith(TrueVal);
-            SI->eraseFromParent();
+  // Replace every value the solver proved constant. Blocks that never became
+  // executable keep their code here: once their branch conditions are
+  // constants, the worklist in run() folds the branches and deletes them.
+  bool runSCCP(Function &F, FunctionAnalysisManager &AM) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    const TargetLibraryInfo &TLI = AM.getResult<TargetLibraryAnalysis>(F);
+
+    SparseConstantSolver Solver(DL, &TLI);
+    Solver.solve(F);
+
+    bool Changed = false;
+    for (BasicBlock &BB : F) {
+      if (!Solver.isExecutable(&BB))
+        continue;
+      for (auto It = BB.begin(); It != BB.end();) {
+        Instruction &I = *It++;
+        if (I.getType()->isVoidTy())
+          continue;
+        LatticeVal LV = Solver.getValue(&I);
+        if (!LV.isConstant())
+          continue;
+        I.replaceAllUsesWith(LV.C);
+        // folded calls only have the side effects ConstantFoldCall ruled out
+        if (!I.mayHaveSideEffects() || isa<CallInst>(I))
+          I.eraseFromParent();
+        Changed = true;
+      }
+    }
+    return Changed;
+  }
+
+public:
+  explicit ThePass(ConstantPropagationOptions Opts = {}) : Opts(Opts) {}
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    bool Changed = false;
+    Module *M = F.getParent();
+    const DataLayout &DL = M->getDataLayout();
+    const TargetLibraryInfo &TLI = AM.getResult<TargetLibraryAnalysis>(F);
+
+    // the SCCP mode solves the whole function first, then the peephole
+    // worklist below cleans up the algebraic identities on what is left
+    if (Opts.SCCP)
+      Changed |= runSCCP(F, AM);
+    if (Opts.Ranges)
+      Changed |= runRanges(F, AM);
+
+    // Worklist driver: every instruction is visited once, and whenever one
+    // is replaced its users are pushed back, so folds cascade transitively
+    // regardless of layout order at O(#changes) extra cost.
+    SmallVector<Instruction *, 64> Worklist;
+    SmallPtrSet<Instruction *, 32> InWorklist;
+    auto Push = [&](Instruction *I) {
+      if (InWorklist.insert(I).second)
+        Worklist.push_back(I);
+    };
+
+    // seed in reverse so that popping from the back visits in layout order
+    for (BasicBlock &BB : reverse(F))
+      for (Instruction &I : reverse(BB))
+        Push(&I);
+
+    SmallVector<BasicBlock *, 8> Lost;
+    auto PushPHIs = [&](BasicBlock *BB) {
+      for (PHINode &PN : BB->phis())
+        Push(&PN);
+    };
+
+    while (!Worklist.empty()) {
+      while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        InWorklist.erase(I);
+
+        // br/switch on a constant => unconditional branch
+        if (I->isTerminator()) {
+          if (BasicBlock *Dest = getConstantSuccessor(*I)) {
+            foldTerminator(*I, Dest, Lost);
             Changed = true;
           }
+          continue;
         }
+
+        Value *V = simplifyInstruction(*I, DL, &TLI);
+        // self-referencing code can only appear in unreachable blocks
+        if (!V || V == I)
+          continue;
+
+        for (User *U : I->users())
+          if (auto *UI = dyn_cast<Instruction>(U))
+            if (UI != I)
+              Push(UI);
+
+        I->replaceAllUsesWith(V);
+        I->eraseFromParent();
+        Changed = true;
       }
+
+      if (Lost.empty())
+        break;
+
+      // Some edges were removed: delete the blocks no longer reachable from
+      // the entry, then revisit the PHIs of the survivors that lost incoming
+      // edges. Deleting only happens with an empty worklist, so no pointer
+      // in it can dangle.
+      df_iterator_default_set<BasicBlock *> Reachable;
+      for (BasicBlock *BB : depth_first_ext(&F, Reachable))
+        (void)BB;
+
+      SmallVector<BasicBlock *, 8> Dead;
+      for (BasicBlock &BB : F)
+        if (!Reachable.count(&BB))
+          Dead.push_back(&BB);
+      for (BasicBlock *BB : Dead)
+        for (BasicBlock *Succ : successors(BB))
+          if (Reachable.count(Succ))
+            Lost.push_back(Succ);
+      DeleteDeadBlocks(Dead, /*DTU=*/nullptr, /*KeepOneInputPHIs=*/true);
+
+      for (BasicBlock *BB : Lost)
+        if (Reachable.count(BB))
+          PushPHIs(BB);
+      Lost.clear();
     }
 
     if (Changed) {
@@ -331,6 +1053,156 @@ public:
     return PreservedAnalyses::all();
   }
 };
+
+// Interprocedural constant propagation.
+//
+// Constants passed by every call site of an internal function are pushed
+// into its formal arguments, and a function that always returns the same
+// constant has the results of its calls replaced. Each round then runs the
+// intra-procedural folding on every function, which may expose new constant
+// arguments and returns, until nothing changes.
+class IPConstantPropagation : public PassInfoMixin<IPConstantPropagation> {
+private:
+  // Bound on the propagate/fold rounds, each one is a full module sweep.
+  static constexpr unsigned MaxRounds = 8;
+
+  // Collect the direct call sites of F. Return false if F is used in any
+  // other way (address taken, call with a mismatched signature, ...).
+  static bool collectCallSites(Function &F,
+                               SmallVectorImpl<CallBase *> &Calls) {
+    for (Use &U : F.uses()) {
+      auto *CB = dyn_cast<CallBase>(U.getUser());
+      if (!CB || !CB->isCallee(&U) ||
+          CB->getFunctionType() != F.getFunctionType())
+        return false;
+      Calls.push_back(CB);
+    }
+    return true;
+  }
+
+  // Common constant of Values, skipping undef. nullptr if there is none.
+  template <typename RangeT> static Constant *getCommonConstant(RangeT &&Values) {
+    Constant *Common = nullptr;
+    for (Value *V : Values) {
+      if (isa<UndefValue>(V))
+        continue;
+      auto *C = dyn_cast<Constant>(V);
+      if (!C || (Common && C != Common))
+        return nullptr;
+      Common = C;
+    }
+    return Common;
+  }
+
+  // Replace the uses of formal arguments that receive the same constant
+  // from every call site. Only internal functions have all callers visible.
+  static bool propagateArguments(Function &F, ArrayRef<CallBase *> Calls) {
+    if (!F.hasLocalLinkage() || Calls.empty())
+      return false;
+
+    bool Changed = false;
+    for (Argument &Arg : F.args()) {
+      // these attributes make the callee see a copy, not the passed value
+      if (Arg.use_empty() || Arg.hasByValAttr() || Arg.hasInAllocaAttr() ||
+          Arg.hasPreallocatedAttr())
+        continue;
+      unsigned ArgNo = Arg.getArgNo();
+      Constant *C = getCommonConstant(
+          map_range(Calls, [ArgNo](CallBase *CB) {
+            return CB->getArgOperand(ArgNo);
+          }));
+      if (!C)
+        continue;
+      errs() << "IPCP: " << F.getName() << " argument " << ArgNo
+             << " is always " << *C << "\n";
+      Arg.replaceAllUsesWith(C);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+  // Replace the results of calls to a function that always returns the same
+  // constant. The calls themselves stay for their side effects.
+  static bool propagateReturn(Function &F, ArrayRef<CallBase *> Calls) {
+    // an interposable definition may be replaced at link time
+    if (F.getReturnType()->isVoidTy() || !F.hasExactDefinition())
+      return false;
+
+    SmallVector<Value *, 4> Returned;
+    for (BasicBlock &BB : F)
+      if (auto *RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+        Returned.push_back(RI->getReturnValue());
+    Constant *C = getCommonConstant(Returned);
+    if (!C)
+      return false;
+
+    bool Changed = false;
+    for (CallBase *CB : Calls) {
+      // the value of a musttail call must flow straight into a ret
+      auto *CI = dyn_cast<CallInst>(CB);
+      if (CB->use_empty() || (CI && CI->isMustTailCall()))
+        continue;
+      CB->replaceAllUsesWith(C);
+      Changed = true;
+    }
+    if (Changed)
+      errs() << "IPCP: " << F.getName() << " always returns " << *C << "\n";
+    return Changed;
+  }
+
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    FunctionAnalysisManager &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    bool Changed = false;
+    for (unsigned Round = 0; Round != MaxRounds; ++Round) {
+      bool RoundChanged = false;
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+        SmallVector<CallBase *, 8> Calls;
+        if (!collectCallSites(F, Calls))
+          continue;
+        RoundChanged |= propagateArguments(F, Calls);
+        RoundChanged |= propagateReturn(F, Calls);
+      }
+      if (!RoundChanged)
+        break;
+      Changed = true;
+
+      // fold what the new constants expose, SCCP also sees through the
+      // branches they decide
+      for (Function &F : M) {
+        if (F.isDeclaration())
+          continue;
+        ConstantPropagationOptions Opts;
+        Opts.SCCP = true;
+        PreservedAnalyses PA = ThePass(Opts).run(F, FAM);
+        FAM.invalidate(F, PA);
+      }
+    }
+
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+// Parse `ConstantPropagation<opt1;opt2;...>`.
+bool parseOptions(StringRef Name, ConstantPropagationOptions &Opts) {
+  if (!Name.consume_front(PASS_NAME "<") || !Name.consume_back(">"))
+    return false;
+  SmallVector<StringRef, 2> Params;
+  Name.split(Params, ';');
+  for (StringRef Param : Params) {
+    if (Param == "sccp")
+      Opts.SCCP = true;
+    else if (Param == "range")
+      Opts.Ranges = true;
+    else
+      return false;
+  }
+  return true;
+}
 } // end anonymous namespace
 
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -343,6 +1215,20 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     FPM.addPass(ThePass());
                     return true;
                   }
+                  ConstantPropagationOptions Opts;
+                  if (parseOptions(Name, Opts)) {
+                    FPM.addPass(ThePass(Opts));
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME "<ipcp>") {
+                    MPM.addPass(IPConstantPropagation());
+                    return true;
+                  }
                   return false;
                 });
           }};
@@ -1,5 +1,10 @@
+#include <math.h>
 #include <stdbool.h>
 
+typedef int v4si __attribute__((vector_size(16)));
+
+static const int table[4] = {1, 2, 4, 8};
+
 int test_arithmetic(int x, int y) {
     // Constant folding: both operands are constants
     int a = 3 + 5;           // => 8
@@ -135,6 +140,105 @@ unsigned int test_unsigned(unsigned int x) {
     return a + b + c;
 }
 
+int test_sccp(int x) {
+    // Constants flowing through PHIs and guarded by constant branches,
+    // only found by the ConstantPropagation<sccp> mode
+    int a = 4;
+    int b;
+    if (a > 2)
+        b = a * 2;           // => 8
+    else
+        b = x;               // never executed
+    
+    int c = 0;
+    for (int i = 0; i < x; i++)
+        c = c * 3;           // c stays 0 around the loop
+    
+    return b + c;            // => 8
+}
+
+int test_branch(int x) {
+    // Constant branches and switches become unconditional, and the
+    // blocks they no longer reach are deleted
+    int a;
+    if (x == x)              // => true
+        a = 1;
+    else
+        a = x * 3;           // unreachable, deleted
+    
+    switch (a) {             // => case 1
+    case 1:
+        return x;
+    case 2:
+        return x + 2;        // unreachable, deleted
+    default:
+        return 0;            // unreachable, deleted
+    }
+}
+
+int test_vector(int x) {
+    v4si v = {x, x, x, x};
+    v4si zero = {0, 0, 0, 0};
+    v4si one = {1, 1, 1, 1};
+    
+    // Identities apply lane-wise on splat constants
+    v4si a = v + zero;       // => v
+    v4si b = v * one;        // => v
+    v4si c = v & ~zero;      // => v
+    
+    // Constant vectors fold lane-wise, element extracts fold too
+    v4si d = (v4si){1, 2, 3, 4} + (v4si){4, 3, 2, 1}; // => <5, 5, 5, 5>
+    v4si e = __builtin_shufflevector(d, one, 0, 4, 1, 5); // => <5, 1, 5, 1>
+    
+    return a[0] + b[1] + c[2] + d[3] + e[1];  // => 3 * x + 6
+}
+
+double test_table_and_libm(int x) {
+    // Loads from constant tables through constant indices
+    int i = 3;
+    int a = table[i];            // => 8
+    int b = table[1] + table[2]; // => 6
+    
+    // Pure intrinsics and libm calls with literal arguments
+    double c = sqrt(16.0);       // => 4.0
+    double d = fabs(-2.5);       // => 2.5
+    double e = sqrt(-1.0);       // kept: sets errno
+    
+    return a + b + c + d + e + x;
+}
+
+// Internal helpers only ever called with the same literal argument, or
+// always returning a constant, are specialized by ConstantPropagation<ipcp>
+static int scaled(int x, int mode) {
+    if (mode == 0)           // mode is always 0 => branch folded
+        return x * 2;
+    return x * mode;
+}
+
+static int default_mode(void) {
+    return 0;                // call sites use 0 directly
+}
+
+int test_ipcp(int x) {
+    return scaled(x, 0) + scaled(x + 1, default_mode());
+}
+
+int test_ranges(int x, int n, unsigned char c) {
+    // Comparisons decided by value ranges, found by ConstantPropagation<range>
+    int a = (x & 15) < 16;               // => true: mask bounds the value
+    int b = (x % 10) < 10 && x >= 0;     // only the first compare folds
+    int d = (int)c >= 0;                 // => true: zext is non-negative
+    
+    int e = 0;
+    if (n < 100) {
+        if (n > 5) {
+            e = n < 200;                 // => true: dominating branch
+            e += n * 3;                  // nsw/nuw: 18 <= n * 3 <= 297
+        }
+    }
+    return a + b + d + e;
+}
+
 int main() {
     int x = 42, y = 17;
     float fx = 3.14f, fy = 2.71f;
@@ -148,6 +252,12 @@ int main() {
     result += test_select(x, y, cond);
     result += test_complex(x, y);
     result += (int)test_unsigned((unsigned int)x);
+    result += test_sccp(x);
+    result += test_branch(x);
+    result += test_vector(x);
+    result += (int)test_table_and_libm(x);
+    result += test_ipcp(x);
+    result += test_ranges(x, y, (unsigned char)x);
     
     return result;
 }
\ No newline at end of file
@@ -1,18 +1,371 @@
+#include <llvm/ADT/DepthFirstIterator.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/CaptureTracking.h>
+#include <llvm/Analysis/IteratedDominanceFrontier.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 using namespace llvm;
 
 namespace {
+
+// Options of the pass, spelled DeadCodeElimination<aggressive;memory>.
+struct DeadCodeEliminationOptions {
+  bool Aggressive = false;
+  bool Memory = false;
+};
+
+// Memory-aware dead code elimination.
+//
+// A store is dead when a later store in the same block overwrites the same
+// location before anything may read it. A local alloca that never escapes
+// and is never read only receives dead stores, so the stores, the address
+// computations and the alloca itself are all removed.
+class DeadStoreElimination {
+private:
+  // Bound on the instructions scanned after each store, to stay linear on
+  // huge blocks.
+  static constexpr unsigned ScanLimit = 128;
+
+  Function &F;
+  AAResults &AA;
+  const DataLayout &DL;
+
+  static bool isLocalAlloca(const Value *Ptr) {
+    return isa<AllocaInst>(getUnderlyingObject(Ptr));
+  }
+
+  // Two loads of a pointer from the same local alloca give the same pointer
+  // when the alloca does not escape and nothing in between may write it,
+  // as with the reloads of a pointer argument's stack slot at -O0.
+  bool isSameLoadedPointer(Value *A, Value *B) {
+    auto *LA = dyn_cast<LoadInst>(A);
+    auto *LB = dyn_cast<LoadInst>(B);
+    if (!LA || !LB || !LA->isSimple() || !LB->isSimple() ||
+        LA->getPointerOperand() != LB->getPointerOperand() ||
+        LA->getType() != LB->getType() || LA->getParent() != LB->getParent())
+      return false;
+    auto *Slot = dyn_cast<AllocaInst>(LA->getPointerOperand());
+    if (!Slot || PointerMayBeCaptured(Slot, /*ReturnCaptures=*/true,
+                                      /*StoreCaptures=*/true))
+      return false;
+
+    if (LB->comesBefore(LA))
+      std::swap(LA, LB);
+    MemoryLocation SlotLoc = MemoryLocation::get(LA);
+    for (auto It = std::next(LA->getIterator()); &*It != LB; ++It)
+      if (isModSet(AA.getModRefInfo(&*It, SlotLoc)))
+        return false;
+    return true;
+  }
+
+  // Return true if a later store in the block overwrites all of SI before
+  // the location may be read.
+  bool isOverwritten(StoreInst *SI) {
+    MemoryLocation Loc = MemoryLocation::get(SI);
+    TypeSize Size = DL.getTypeStoreSize(SI->getValueOperand()->getType());
+    // an unwinding instruction lets the caller observe non-local memory
+    bool Local = isLocalAlloca(SI->getPointerOperand());
+
+    unsigned Scanned = 0;
+    for (auto It = std::next(SI->getIterator()), E = SI->getParent()->end();
+         It != E && Scanned != ScanLimit; ++It, ++Scanned) {
+      Instruction &I = *It;
+      if (auto *Later = dyn_cast<StoreInst>(&I)) {
+        if (Later->isSimple() &&
+            (AA.isMustAlias(MemoryLocation::get(Later), Loc) ||
+             isSameLoadedPointer(Later->getPointerOperand(),
+                                 SI->getPointerOperand())) &&
+            TypeSize::isKnownGE(
+                DL.getTypeStoreSize(Later->getValueOperand()->getType()),
+                Size))
+          return true;
+      }
+      if (isRefSet(AA.getModRefInfo(&I, Loc)))
+        return false;
+      if (!Local && I.mayThrow())
+        return false;
+    }
+    return false;
+  }
+
+  // Collect the users of a local alloca if it is only ever written: plain
+  // stores and memsets into it, lifetime markers, and address computations
+  // with the same property. Anything else may read it or let it escape.
+  static bool isWriteOnly(AllocaInst *AI, SmallVectorImpl<Instruction *> &Users) {
+    SmallVector<Instruction *, 8> Worklist = {AI};
+    while (!Worklist.empty()) {
+      Instruction *Ptr = Worklist.pop_back_val();
+      for (User *U : Ptr->users()) {
+        auto *UI = cast<Instruction>(U);
+        if (auto *SI = dyn_cast<StoreInst>(UI)) {
+          // storing the address itself lets it escape
+          if (SI->getValueOperand() == Ptr || SI->isVolatile())
+            return false;
+        } else if (auto *MS = dyn_cast<MemSetInst>(UI)) {
+          if (MS->isVolatile())
+            return false;
+        } else if (auto *II = dyn_cast<IntrinsicInst>(UI)) {
+          if (!II->isLifetimeStartOrEnd())
+            return false;
+        } else if (isa<GetElementPtrInst, BitCastInst>(UI)) {
+          Worklist.push_back(UI);
+        } else {
+          return false;
+        }
+        Users.push_back(UI);
+      }
+    }
+    return true;
+  }
+
+  bool eliminateOverwrittenStores() {
+    SmallVector<StoreInst *, 16> Dead;
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (auto *SI = dyn_cast<StoreInst>(&I))
+          if (SI->isSimple() && isOverwritten(SI))
+            Dead.push_back(SI);
+
+    for (StoreInst *SI : Dead) {
+      errs() << "DSE: removing overwritten store " << *SI << "\n";
+      SI->eraseFromParent();
+    }
+    return !Dead.empty();
+  }
+
+  bool eliminateWriteOnlyAllocas() {
+    SmallVector<AllocaInst *, 8> Allocas;
+    for (Instruction &I : F.getEntryBlock())
+      if (auto *AI = dyn_cast<AllocaInst>(&I))
+        Allocas.push_back(AI);
+
+    bool Changed = false;
+    for (AllocaInst *AI : Allocas) {
+      SmallVector<Instruction *, 16> Users;
+      if (!isWriteOnly(AI, Users))
+        continue;
+      errs() << "DSE: removing write-only alloca " << *AI << "\n";
+      // users were collected defs first, erase them uses first
+      for (Instruction *UI : reverse(Users))
+        UI->eraseFromParent();
+      AI->eraseFromParent();
+      Changed = true;
+    }
+    return Changed;
+  }
+
+public:
+  DeadStoreElimination(Function &F, AAResults &AA)
+      : F(F), AA(AA), DL(F.getParent()->getDataLayout()) {}
+
+  bool run() {
+    bool Changed = eliminateOverwrittenStores();
+    Changed |= eliminateWriteOnlyAllocas();
+    return Changed;
+  }
+};
+
+// Aggressive dead code elimination (mark and sweep).
+//
+// Everything is assumed dead until proven live. Roots are instructions with
+// side effects, returns and other non-branch terminators, plus the branches
+// of loop back edges so that (possibly infinite) loops are never removed.
+// Liveness flows to operands, to the terminators of the predecessors of a
+// live PHI, and through control dependence: when a block becomes live, the
+// branches in its post-dominance frontier become live. Whatever stays
+// unmarked is deleted, including PHI cycles that only feed themselves, and
+// dead conditional branches become unconditional.
+class AggressiveDCE {
+private:
+  Function &F;
+  PostDominatorTree &PDT;
+
+  SmallPtrSet<Instruction *, 32> Live;
+  SmallPtrSet<BasicBlock *, 16> LiveBlocks;
+  SmallVector<Instruction *, 64> Worklist;
+  // blocks that became live since the last control dependence round
+  SmallPtrSet<BasicBlock *, 16> NewLiveBlocks;
+
+  static bool isRoot(Instruction &I) {
+    if (I.isTerminator())
+      return !isa<BranchInst, SwitchInst>(I);
+    return I.mayHaveSideEffects() || I.isEHPad();
+  }
+
+  void markLive(Instruction *I) {
+    if (!Live.insert(I).second)
+      return;
+    Worklist.push_back(I);
+    if (LiveBlocks.insert(I->getParent()).second)
+      NewLiveBlocks.insert(I->getParent());
+  }
+
+  // Branches that close a cycle stay, deleting them could remove an
+  // infinite loop.
+  void markBackEdgeBranchesLive() {
+    SmallPtrSet<BasicBlock *, 16> OnStack;
+    SmallPtrSet<BasicBlock *, 16> Visited;
+    SmallVector<std::pair<BasicBlock *, succ_iterator>, 16> Stack;
+
+    BasicBlock *Entry = &F.getEntryBlock();
+    Visited.insert(Entry);
+    OnStack.insert(Entry);
+    Stack.push_back({Entry, succ_begin(Entry)});
+    while (!Stack.empty()) {
+      BasicBlock *BB = Stack.back().first;
+      succ_iterator &It = Stack.back().second;
+      if (It == succ_end(BB)) {
+        OnStack.erase(BB);
+        Stack.pop_back();
+        continue;
+      }
+      BasicBlock *Succ = *It++;
+      if (OnStack.count(Succ)) {
+        markLive(BB->getTerminator());
+        continue;
+      }
+      if (Visited.insert(Succ).second) {
+        OnStack.insert(Succ);
+        Stack.push_back({Succ, succ_begin(Succ)});
+      }
+    }
+  }
+
+  void markLiveInstructions() {
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (isRoot(I))
+          markLive(&I);
+    markBackEdgeBranchesLive();
+
+    do {
+      while (!Worklist.empty()) {
+        Instruction *I = Worklist.pop_back_val();
+        for (Value *Op : I->operands())
+          if (auto *OpI = dyn_cast<Instruction>(Op))
+            markLive(OpI);
+        // a live PHI needs the edges it selects between
+        if (auto *PN = dyn_cast<PHINode>(I))
+          for (BasicBlock *Pred : PN->blocks())
+            markLive(Pred->getTerminator());
+      }
+
+      // the branches a live block is control dependent on are live
+      if (NewLiveBlocks.empty())
+        break;
+      ReverseIDFCalculator IDF(PDT);
+      IDF.setDefiningBlocks(NewLiveBlocks);
+      SmallVector<BasicBlock *, 16> ControlDeps;
+      IDF.calculate(ControlDeps);
+      NewLiveBlocks.clear();
+      for (BasicBlock *BB : ControlDeps)
+        markLive(BB->getTerminator());
+    } while (!Worklist.empty());
+  }
+
+public:
+  AggressiveDCE(Function &F, PostDominatorTree &PDT) : F(F), PDT(PDT) {}
+
+  bool run() {
+    markLiveInstructions();
+
+    // Sweep: detach every dead instruction first, so that dead cycles can be
+    // erased in any order.
+    SmallVector<Instruction *, 64> Dead;
+    SmallVector<Instruction *, 8> DeadBranches;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        if (Live.count(&I))
+          continue;
+        if (I.isTerminator())
+          DeadBranches.push_back(&I);
+        else
+          Dead.push_back(&I);
+      }
+    }
+    if (Dead.empty() && DeadBranches.empty())
+      return false;
+
+    for (Instruction *I : Dead)
+      I->dropAllReferences();
+    for (Instruction *I : Dead) {
+      I->replaceAllUsesWith(PoisonValue::get(I->getType()));
+      I->eraseFromParent();
+    }
+
+    // A dead branch selects between paths without live code up to its
+    // immediate post-dominator, and none of its edges is a back edge or
+    // feeds a live PHI, so any successor leads there.
+    bool RemovedEdge = false;
+    for (Instruction *Term : DeadBranches) {
+      BasicBlock *BB = Term->getParent();
+      if (isa<BranchInst>(Term) && cast<BranchInst>(Term)->isUnconditional())
+        continue;
+      BasicBlock *Target = Term->getSuccessor(0);
+      bool KeptTarget = false;
+      for (BasicBlock *Succ : successors(BB)) {
+        if (Succ == Target && !KeptTarget) {
+          KeptTarget = true;
+          continue;
+        }
+        Succ->removePredecessor(BB);
+        RemovedEdge = true;
+      }
+      Term->eraseFromParent();
+      BranchInst::Create(Target, BB);
+    }
+
+    // folding branches can leave whole dead regions unreachable
+    if (RemovedEdge) {
+      df_iterator_default_set<BasicBlock *> Reachable;
+      for (BasicBlock *BB : depth_first_ext(&F, Reachable))
+        (void)BB;
+      SmallVector<BasicBlock *, 8> Unreachable;
+      for (BasicBlock &BB : F)
+        if (!Reachable.count(&BB))
+          Unreachable.push_back(&BB);
+      DeleteDeadBlocks(Unreachable);
+    }
+    return true;
+  }
+};
+
 class ThePass : public PassInfoMixin<ThePass> {
+private:
+  DeadCodeEliminationOptions Opts;
+
 public:
+  explicit ThePass(DeadCodeEliminationOptions Opts = {}) : Opts(Opts) {}
+
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
     errs() << "Running DCE on function: " << F.getName() << "\n";
 
     bool Changed = false;
+
+    // remove dead stores first, the values only they used become dead too
+    if (Opts.Memory) {
+      AAResults &AA = AM.getResult<AAManager>(F);
+      Changed |= DeadStoreElimination(F, AA).run();
+    }
+
+    if (Opts.Aggressive) {
+      PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+      Changed |= AggressiveDCE(F, PDT).run();
+      return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
     SmallVector<Instruction *, 16> ToErase;
 
     for (auto &BB : F) {
@@ -57,6 +410,257 @@ public:
     return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
   }
 };
+
+// Module-level dead code elimination.
+//
+// Dead argument elimination rewrites internal functions whose signature
+// carries arguments nobody reads or a return value no caller uses. Then every
+// global value is assumed dead until reached from a root: anything that may
+// be referenced from outside the module (external linkage, llvm.used, ctors,
+// ...). Liveness flows through function bodies, initializers, aliasees and
+// comdats, and the unreached functions and globals are deleted. The two
+// steps alternate, since each can expose more work for the other.
+class DeadGlobalElimination : public PassInfoMixin<DeadGlobalElimination> {
+private:
+  // Bound on the argument/global rounds, each one is a full module sweep.
+  static constexpr unsigned MaxRounds = 4;
+
+  SmallPtrSet<GlobalValue *, 32> Live;
+  SmallVector<GlobalValue *, 32> Worklist;
+  SmallPtrSet<Constant *, 32> VisitedConstants;
+  DenseMap<Comdat *, SmallVector<GlobalValue *, 2>> ComdatMembers;
+
+  void markLive(GlobalValue *GV) {
+    if (!Live.insert(GV).second)
+      return;
+    Worklist.push_back(GV);
+    // a comdat is kept or discarded as a whole
+    if (Comdat *C = GV->getComdat())
+      for (GlobalValue *Member : ComdatMembers.lookup(C))
+        markLive(Member);
+  }
+
+  // Mark the globals V refers to, looking through constant expressions and
+  // aggregates.
+  void markReferenced(Value *V) {
+    if (auto *GV = dyn_cast<GlobalValue>(V))
+      return markLive(GV);
+    auto *C = dyn_cast<Constant>(V);
+    if (!C || !VisitedConstants.insert(C).second)
+      return;
+    for (Value *Op : C->operands())
+      markReferenced(Op);
+  }
+
+  bool eliminateDeadGlobals(Module &M) {
+    Live.clear();
+    VisitedConstants.clear();
+    ComdatMembers.clear();
+    for (GlobalValue &GV : M.global_values())
+      if (Comdat *C = GV.getComdat())
+        ComdatMembers[C].push_back(&GV);
+
+    for (GlobalValue &GV : M.global_values())
+      if (!GV.isDiscardableIfUnused() && !GV.isDeclaration())
+        markLive(&GV);
+
+    while (!Worklist.empty()) {
+      GlobalValue *GV = Worklist.pop_back_val();
+      // initializer, aliasee, personality, prefix data, ...
+      for (Value *Op : GV->operands())
+        markReferenced(Op);
+      if (auto *F = dyn_cast<Function>(GV))
+        for (BasicBlock &BB : *F)
+          for (Instruction &I : BB)
+            for (Value *Op : I.operands())
+              markReferenced(Op);
+    }
+
+    SmallVector<GlobalValue *, 16> Dead;
+    for (GlobalValue &GV : M.global_values())
+      if (!Live.count(&GV))
+        Dead.push_back(&GV);
+    if (Dead.empty())
+      return false;
+
+    // drop every reference out of dead globals first, so that dead cycles
+    // (recursive functions, self-referencing tables) can be erased
+    for (GlobalValue *GV : Dead) {
+      errs() << "GlobalDCE: removing " << GV->getName() << "\n";
+      if (auto *F = dyn_cast<Function>(GV))
+        F->deleteBody();
+      else if (auto *GVar = dyn_cast<GlobalVariable>(GV))
+        GVar->setInitializer(nullptr);
+      else
+        GV->dropAllReferences();
+    }
+    for (GlobalValue *GV : Dead) {
+      GV->removeDeadConstantUsers();
+      if (!GV->use_empty())
+        GV->replaceAllUsesWith(PoisonValue::get(GV->getType()));
+      GV->eraseFromParent();
+    }
+    return true;
+  }
+
+  // Direct call sites of F, or false if F is used in any other way.
+  static bool collectCallSites(Function &F,
+                               SmallVectorImpl<CallBase *> &Calls) {
+    for (Use &U : F.uses()) {
+      auto *CB = dyn_cast<CallBase>(U.getUser());
+      if (!CB || !CB->isCallee(&U) ||
+          CB->getFunctionType() != F.getFunctionType())
+        return false;
+      // a musttail call must match its caller's signature
+      if (auto *CI = dyn_cast<CallInst>(CB))
+        if (CI->isMustTailCall())
+          return false;
+      Calls.push_back(CB);
+    }
+    return true;
+  }
+
+  // Drop the unused arguments and the unused return value of F.
+  static bool eliminateDeadArguments(Function &F) {
+    if (!F.hasLocalLinkage() || F.isDeclaration() || F.isVarArg())
+      return false;
+    SmallVector<CallBase *, 8> Calls;
+    if (!collectCallSites(F, Calls))
+      return false;
+    for (Argument &Arg : F.args())
+      if (Arg.hasInAllocaAttr() || Arg.hasPreallocatedAttr())
+        return false;
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        if (auto *CI = dyn_cast<CallInst>(&I))
+          if (CI->isMustTailCall())
+            return false;
+
+    SmallVector<unsigned, 8> KeptArgs;
+    for (Argument &Arg : F.args())
+      if (!Arg.use_empty())
+        KeptArgs.push_back(Arg.getArgNo());
+    bool DropReturn = !F.getReturnType()->isVoidTy() &&
+                      all_of(Calls, [](CallBase *CB) { return CB->use_empty(); });
+    if (KeptArgs.size() == F.arg_size() && !DropReturn)
+      return false;
+
+    LLVMContext &Ctx = F.getContext();
+    Type *RetTy = DropReturn ? Type::getVoidTy(Ctx) : F.getReturnType();
+    SmallVector<Type *, 8> Params;
+    for (unsigned ArgNo : KeptArgs)
+      Params.push_back(F.getArg(ArgNo)->getType());
+    FunctionType *NewFTy = FunctionType::get(RetTy, Params, false);
+
+    // keep the attributes of the surviving arguments and return value
+    auto RebuildAttrs = [&](AttributeList Attrs) {
+      SmallVector<AttributeSet, 8> ArgAttrs;
+      for (unsigned ArgNo : KeptArgs) {
+        AttributeSet AS = Attrs.getParamAttrs(ArgNo);
+        // `returned` needs a return value to describe
+        if (DropReturn)
+          AS = AS.removeAttribute(Ctx, Attribute::Returned);
+        ArgAttrs.push_back(AS);
+      }
+      return AttributeList::get(
+          Ctx, Attrs.getFnAttrs(),
+          DropReturn ? AttributeSet() : Attrs.getRetAttrs(), ArgAttrs);
+    };
+
+    Function *NewF = Function::Create(NewFTy, F.getLinkage(),
+                                      F.getAddressSpace(), "", nullptr);
+    F.getParent()->getFunctionList().insert(F.getIterator(), NewF);
+    NewF->copyAttributesFrom(&F);
+    NewF->setAttributes(RebuildAttrs(F.getAttributes()));
+    NewF->copyMetadata(&F, 0);
+    NewF->takeName(&F);
+
+    errs() << "DeadArgElim: rewriting " << NewF->getName() << ", dropping "
+           << F.arg_size() - KeptArgs.size() << " argument(s)"
+           << (DropReturn ? " and the return value" : "") << "\n";
+
+    // move the body over and rewire the surviving arguments
+    while (!F.empty()) {
+      BasicBlock &BB = F.front();
+      BB.removeFromParent();
+      BB.insertInto(NewF);
+    }
+    for (unsigned i = 0, e = KeptArgs.size(); i != e; ++i) {
+      Argument *OldArg = F.getArg(KeptArgs[i]);
+      OldArg->replaceAllUsesWith(NewF->getArg(i));
+      NewF->getArg(i)->takeName(OldArg);
+    }
+    if (DropReturn) {
+      for (BasicBlock &BB : *NewF) {
+        if (!isa<ReturnInst>(BB.getTerminator()))
+          continue;
+        BB.getTerminator()->eraseFromParent();
+        ReturnInst::Create(Ctx, &BB);
+      }
+    }
+
+    for (CallBase *CB : Calls) {
+      SmallVector<Value *, 8> Args;
+      for (unsigned ArgNo : KeptArgs)
+        Args.push_back(CB->getArgOperand(ArgNo));
+      SmallVector<OperandBundleDef, 1> Bundles;
+      CB->getOperandBundlesAsDefs(Bundles);
+
+      IRBuilder<> Builder(CB);
+      CallBase *NewCB;
+      if (auto *II = dyn_cast<InvokeInst>(CB))
+        NewCB = Builder.CreateInvoke(NewFTy, NewF, II->getNormalDest(),
+                                     II->getUnwindDest(), Args, Bundles);
+      else
+        NewCB = Builder.CreateCall(NewFTy, NewF, Args, Bundles);
+      if (auto *CI = dyn_cast<CallInst>(CB))
+        cast<CallInst>(NewCB)->setTailCallKind(CI->getTailCallKind());
+      NewCB->setCallingConv(CB->getCallingConv());
+      NewCB->setAttributes(RebuildAttrs(CB->getAttributes()));
+      NewCB->copyMetadata(*CB);
+      if (!DropReturn) {
+        CB->replaceAllUsesWith(NewCB);
+        NewCB->takeName(CB);
+      }
+      CB->eraseFromParent();
+    }
+
+    F.eraseFromParent();
+    return true;
+  }
+
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    bool Changed = false;
+    for (unsigned Round = 0; Round != MaxRounds; ++Round) {
+      bool RoundChanged = false;
+      for (Function &F : make_early_inc_range(M))
+        RoundChanged |= eliminateDeadArguments(F);
+      RoundChanged |= eliminateDeadGlobals(M);
+      if (!RoundChanged)
+        break;
+      Changed = true;
+    }
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+// Parse `DeadCodeElimination<opt1;opt2;...>`.
+bool parseOptions(StringRef Name, DeadCodeEliminationOptions &Opts) {
+  if (!Name.consume_front(PASS_NAME "<") || !Name.consume_back(">"))
+    return false;
+  SmallVector<StringRef, 2> Params;
+  Name.split(Params, ';');
+  for (StringRef Param : Params) {
+    if (Param == "aggressive")
+      Opts.Aggressive = true;
+    else if (Param == "memory")
+      Opts.Memory = true;
+    else
+      return false;
+  }
+  return true;
+}
 } // end anonymous namespace
 
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -69,6 +673,20 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     FPM.addPass(ThePass());
                     return true;
                   }
+                  DeadCodeEliminationOptions Opts;
+                  if (parseOptions(Name, Opts)) {
+                    FPM.addPass(ThePass(Opts));
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME "<module>") {
+                    MPM.addPass(DeadGlobalElimination());
+                    return true;
+                  }
                   return false;
                 });
           }};
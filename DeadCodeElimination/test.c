@@ -67,3 +67,54 @@ int test_all_dead(int a) {
     int z = a - 3;            // Dead
     return 42;                // Only this survives
 }
+
+// Test 9: Dead PHI cycle and dead branch (needs DeadCodeElimination<aggressive>)
+int test_dead_cycle(int n, int a) {
+    int dead = 0;
+    for (int i = 0; i < n; i++)
+        dead = dead + 3;      // Dead: PHI cycle only feeds itself
+    
+    int unused;
+    if (a == 0)               // Dead: only selects between dead values
+        unused = a * 2;
+    else
+        unused = a * 3;
+    return a;
+}
+
+// Test 10: Dead stores (needs DeadCodeElimination<memory>, run without
+// mem2reg so the locals stay in memory)
+int test_dead_stores(int a, int *p) {
+    int scratch[4];
+    scratch[1] = a * 7;       // Dead: scratch is never read, alloca removed
+    
+    int x;
+    x = 1;                    // Dead: overwritten before any load
+    x = 2;
+    
+    *p = a;                   // Dead: overwritten below
+    *p = x;
+    return x;
+}
+
+// Test 11: Dead functions, globals and arguments (needs the module pass
+// DeadCodeElimination<module>)
+static int dead_table[4] = {1, 2, 3, 4};  // Dead: never referenced
+
+static int dead_helper(int a) {           // Dead: never called
+    return dead_table[a & 3];
+}
+
+static int scale(int a, int unused) {     // `unused` argument is dropped
+    return a * 2;
+}
+
+static int log_value(int a) {             // return value is dropped
+    global_var = a;
+    return a;
+}
+
+int test_module_dead(int a) {
+    log_value(a);
+    return scale(a, 42);
+}
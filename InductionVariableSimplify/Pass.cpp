@@ -0,0 +1,258 @@
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
+
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+
+namespace {
+
+// Induction variable simplification on top of ScalarEvolution. In every
+// loop, from inner to outer loops:
+//
+//   - header PHIs that step like an earlier one are rewritten in terms of
+//     it, {5,+,1} as {0,+,1} + 5, so one recurrence is updated instead of
+//     two;
+//   - multiplications by an induction variable, {0,+,s} for i * s, become a
+//     recurrence of their own that adds s every iteration;
+//   - when the trip count is known, values used after the loop are
+//     computed there from values before the loop, so the loop no longer
+//     has to produce them.
+class ThePass : public PassInfoMixin<ThePass> {
+private:
+  // S can be computed at InsertPt: the values it uses are available there,
+  // and it does not divide, which might trap.
+  static bool canExpand(const SCEV *S, Instruction *InsertPt,
+                        DominatorTree &DT) {
+    return !SCEVExprContains(S, [&](const SCEV *Op) {
+      if (isa<SCEVUDivExpr>(Op))
+        return true;
+      auto *U = dyn_cast<SCEVUnknown>(Op);
+      auto *I = U ? dyn_cast<Instruction>(U->getValue()) : nullptr;
+      return I && !DT.dominates(I, InsertPt);
+    });
+  }
+
+  // An affine recurrence of L, or null.
+  static const SCEVAddRecExpr *getAffineAddRec(Value *V, Loop *L,
+                                               ScalarEvolution &SE) {
+    if (!SE.isSCEVable(V->getType()))
+      return nullptr;
+    auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(V));
+    return AR && AR->getLoop() == L && AR->isAffine() ? AR : nullptr;
+  }
+
+  // Rewrite an integer induction variable {S2,+,T} as an earlier one
+  // {S1,+,T} plus the constant S2 - S1. Only an induction variable whose
+  // increment feeds nothing but itself is merged, so its whole update goes
+  // away.
+  static bool mergeIVs(Loop *L, ScalarEvolution &SE,
+                       SmallVectorImpl<WeakTrackingVH> &DeadPHIs) {
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *Latch = L->getLoopLatch();
+    // the first induction variable of each type and step
+    std::map<std::pair<Type *, const SCEV *>, PHINode *> Leaders;
+    SmallVector<PHINode *, 8> PHIs;
+    for (PHINode &PN : Header->phis())
+      PHIs.push_back(&PN);
+
+    bool Changed = false;
+    for (PHINode *PN : PHIs) {
+      const SCEVAddRecExpr *AR = getAffineAddRec(PN, L, SE);
+      if (!PN->getType()->isIntegerTy() || !AR)
+        continue;
+      auto Key = std::make_pair(PN->getType(), AR->getStepRecurrence(SE));
+      PHINode *&Leader = Leaders[Key];
+      if (!Leader) {
+        Leader = PN;
+        continue;
+      }
+
+      auto *Inc = dyn_cast<Instruction>(PN->getIncomingValueForBlock(Latch));
+      if (!Inc || !Inc->hasOneUse())
+        continue;
+      auto *Diff =
+          dyn_cast<SCEVConstant>(SE.getMinusSCEV(AR, SE.getSCEV(Leader)));
+      if (!Diff)
+        continue;
+
+      errs() << "IndVars: merged " << *PN << " into " << *Leader << "\n";
+      Value *New = Leader;
+      if (!Diff->getValue()->isZero()) {
+        IRBuilder<> Builder(Header, Header->getFirstInsertionPt());
+        New = Builder.CreateAdd(Leader, Diff->getValue());
+        New->takeName(PN);
+      }
+      PN->replaceAllUsesWith(New);
+      DeadPHIs.push_back(PN);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+  // A multiplication {S,+,T} of an induction variable becomes a new
+  // induction variable that starts at S and adds T every iteration.
+  static bool reduceMultiplies(Loop *L, ScalarEvolution &SE,
+                               DominatorTree &DT, SCEVExpander &Rewriter,
+                               SmallVectorImpl<WeakTrackingVH> &Dead) {
+    SmallVector<Instruction *, 8> Muls;
+    for (BasicBlock *BB : L->blocks())
+      for (Instruction &I : *BB)
+        if (I.getOpcode() == Instruction::Mul)
+          Muls.push_back(&I);
+
+    bool Changed = false;
+    for (Instruction *I : Muls) {
+      const SCEVAddRecExpr *AR = getAffineAddRec(I, L, SE);
+      if (!AR || !canExpand(AR, I, DT))
+        continue;
+      Value *New = Rewriter.expandCodeFor(AR, I->getType(), I);
+      if (New == I)
+        continue;
+      errs() << "IndVars: reduced " << *I << " to " << *New << "\n";
+      I->replaceAllUsesWith(New);
+      Dead.push_back(I);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+  // Cost of an exit value, in TargetTransformInfo basic units, above which
+  // it is left to the loop.
+  static constexpr unsigned ExpansionBudget = 4;
+
+  // With a known trip count, the value an instruction of L has when L
+  // exits is an expression of values from before the loop, which is
+  // computed in the exit block instead and replaces the LCSSA PHI. Only
+  // loops with one exiting block are handled, in rotated form (exiting from
+  // the latch) or not (exiting from the header, as loops come out of
+  // mem2reg): a value that leaves the loop is defined before the exiting
+  // branch, so it ran in the last, possibly partial, iteration.
+  static bool rewriteExitValues(Loop *L, ScalarEvolution &SE,
+                                DominatorTree &DT,
+                                const TargetTransformInfo &TTI,
+                                SCEVExpander &Rewriter,
+                                SmallVectorImpl<WeakTrackingVH> &Dead) {
+    BasicBlock *Exiting = L->getExitingBlock();
+    BasicBlock *Exit = L->getUniqueExitBlock();
+    if (!Exiting || !Exit ||
+        isa<SCEVCouldNotCompute>(SE.getExitCount(L, Exiting)))
+      return false;
+
+    bool Changed = false;
+    Instruction *InsertPt = &*Exit->getFirstInsertionPt();
+    for (PHINode &PN : Exit->phis()) {
+      auto *I = dyn_cast<Instruction>(PN.getIncomingValueForBlock(Exiting));
+      if (!I || !L->contains(I) || !SE.isSCEVable(I->getType()))
+        continue;
+      const SCEV *S = SE.getSCEVAtScope(I, L->getParentLoop());
+      if (isa<SCEVCouldNotCompute>(S) || !SE.isLoopInvariant(S, L) ||
+          !canExpand(S, InsertPt, DT) ||
+          Rewriter.isHighCostExpansion(S, L, ExpansionBudget, &TTI, InsertPt))
+        continue;
+      Value *New = Rewriter.expandCodeFor(S, PN.getType(), InsertPt);
+      errs() << "IndVars: exit value of " << *I << " is " << *New << "\n";
+      PN.replaceAllUsesWith(New);
+      Dead.push_back(&PN);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+  static bool runOnLoop(Loop *L, ScalarEvolution &SE, DominatorTree &DT,
+                        const TargetTransformInfo &TTI) {
+    // LoopSimplify gives every loop a preheader; bail out if it did not run
+    if (!L->getLoopPreheader() || !L->getLoopLatch())
+      return false;
+
+    SmallVector<WeakTrackingVH, 8> DeadPHIs;
+    SmallVector<WeakTrackingVH, 16> Dead;
+    bool Changed = mergeIVs(L, SE, DeadPHIs);
+
+    const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+    // not in canonical mode, so recurrences are expanded as they are
+    // rather than in terms of a canonical induction variable
+    SCEVExpander Rewriter(SE, DL, "indvars");
+    Rewriter.disableCanonicalMode();
+    Changed |= reduceMultiplies(L, SE, DT, Rewriter, Dead);
+    Changed |= rewriteExitValues(L, SE, DT, TTI, Rewriter, Dead);
+    // the expander keeps handles to what it inserted, some of which may die
+    Rewriter.clear();
+
+    if (!Changed)
+      return false;
+
+    RecursivelyDeleteTriviallyDeadInstructionsPermissive(Dead);
+    for (WeakTrackingVH &V : DeadPHIs)
+      if (auto *PN = dyn_cast_or_null<PHINode>(V))
+        RecursivelyDeleteDeadPHINode(PN);
+    // induction variables whose users were all replaced
+    for (PHINode &PN : make_early_inc_range(L->getHeader()->phis()))
+      RecursivelyDeleteDeadPHINode(&PN);
+    SE.forgetLoop(L);
+    return true;
+  }
+
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+
+    // LoopSimplify form for preheaders and latches, and LCSSA form so that
+    // every value used after a loop goes through a PHI in its exit block
+    bool Changed = false;
+    for (Loop *L : LI) {
+      Changed |= simplifyLoop(L, &DT, &LI, &SE, nullptr, nullptr,
+                              /*PreserveLCSSA=*/false);
+      Changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+    }
+
+    // inner loops first, so the exit values of an inner loop are seen as
+    // recurrences of the loop around it
+    SmallVector<Loop *, 8> Loops = LI.getLoopsInPreorder();
+    std::reverse(Loops.begin(), Loops.end());
+    for (Loop *L : Loops)
+      Changed |= runOnLoop(L, SE, DT, TTI);
+
+    if (!Changed)
+      return PreservedAnalyses::all();
+    // only LoopSimplify changes the CFG, and it keeps both up to date
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    return PA;
+  }
+};
+} // end anonymous namespace
+
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, PASS_NAME_EXT, LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME) {
+                    FPM.addPass(ThePass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
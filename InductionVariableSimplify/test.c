@@ -0,0 +1,45 @@
+// Test cases for the induction variable simplification pass
+
+void strided(int *a, int n, int stride) {
+  // i * stride becomes a variable that adds stride every iteration
+  for (int i = 0; i < n; i++)
+    a[i * stride] = i;
+}
+
+void two_counters(int *a, int n) {
+  // j is always i + 5, so only i is updated
+  int j = 5;
+  for (int i = 0; i < n; i++) {
+    a[i] = j;
+    j++;
+  }
+}
+
+int matrix(int *a, int rows, int cols) {
+  int last = 0;
+  for (int i = 0; i < rows; i++) {
+    // the row offset i * cols is reduced in the outer loop
+    for (int j = 0; j < cols; j++)
+      a[i * cols + j] = i + j;
+    last += cols;
+  }
+  // last is rows * cols, computed after the loop
+  return last;
+}
+
+int count(int n) {
+  int c = 0;
+  for (int i = 0; i < n; i++)
+    c += 3;
+  // c is computed as 3 * n after the loop, which keeps only its counter
+  return c;
+}
+
+int main(void) {
+  int a[64];
+  strided(a, 8, 4);
+  two_counters(a, 8);
+  int r = matrix(a, 4, 8);
+  r += count(10);
+  return r + a[3];
+}
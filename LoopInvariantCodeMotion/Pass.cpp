@@ -1,127 +1,766 @@
+#include <llvm/ADT/MapVector.h>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/DomTreeUpdater.h>
 #include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/LoopIterator.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/SSAUpdater.h>
+
+#include <algorithm>
 
 using namespace llvm;
 
 namespace {
 
+// Options of the function pass, spelled
+// LoopInvariantCodeMotion<unswitch;unswitch-budget=N>.
+struct LoopInvariantCodeMotionOptions {
+  bool Unswitch = false;
+  // number of instructions unswitching may duplicate per function
+  unsigned UnswitchBudget = 200;
+};
+
+// Memory effects of a loop: the instructions that may write memory, and
+// whether control may leave the loop other than through its exits.
+struct LoopMemory {
+  SmallVector<Instruction *, 8> Writers;
+  bool MayThrow = false;
+};
+
+// Rewrites the promoted loads and stores of one location in a loop to SSA
+// values, and stores the value live at each exit back to memory.
+class ScalarPromoter : public LoadAndStorePromoter {
+  Value *Ptr;
+  ArrayRef<BasicBlock *> ExitBlocks;
+  Align Alignment;
+
+public:
+  ScalarPromoter(ArrayRef<const Instruction *> Insts, SSAUpdater &S,
+                 Value *Ptr, ArrayRef<BasicBlock *> ExitBlocks,
+                 Align Alignment)
+      : LoadAndStorePromoter(Insts, S), Ptr(Ptr), ExitBlocks(ExitBlocks),
+        Alignment(Alignment) {}
+
+  void doExtraRewritesBeforeFinalDeletion() override {
+    for (BasicBlock *Exit : ExitBlocks) {
+      Value *LiveOut = SSA.GetValueInMiddleOfBlock(Exit);
+      IRBuilder<> Builder(&*Exit->getFirstInsertionPt());
+      Builder.CreateAlignedStore(LiveOut, Ptr, Alignment);
+    }
+  }
+};
+
 class LoopInvariantCodeMotion : public PassInfoMixin<LoopInvariantCodeMotion> {
 private:
-  bool isLoopInvariant(Instruction *I, Loop *L, DominatorTree &DT) {
-    // skip phi nodes
-    if (isa<PHINode>(I))
-      return false;
+  LoopInvariantCodeMotionOptions Opts;
 
-    // skip instructions with side effects
-    if (I->mayHaveSideEffects())
-      return false;
+  // Compute the loop-invariant instructions of L in one pass over its
+  // blocks in reverse post-order. Every operand defined in the loop, other
+  // than through a PHI, comes earlier in that order, so its invariance is
+  // already known when an instruction is visited.
+  void computeInvariants(Loop *L, LoopInfo &LI, AAResults &AA,
+                         const LoopMemory &Mem,
+                         SmallPtrSetImpl<Instruction *> &Invariant) {
+    LoopBlocksRPO RPOT(L);
+    RPOT.perform(&LI);
+    for (BasicBlock *BB : RPOT) {
+      for (Instruction &I : *BB) {
+        // skip phi nodes
+        if (isa<PHINode>(&I))
+          continue;
 
-    // check whether all operands are loop invariant(out of loop or constants)
-    for (Value *Op : I->operands()) {
-      // if the operand is an instruction
-      if (auto *OpI = dyn_cast<Instruction>(Op)) {
-        // if the operand is inside the loop, check if it's loop invariant
-        if (L->contains(OpI)) {
-          if (!isLoopInvariant(OpI, L, DT))
-            return false;
+        // skip instructions with side effects
+        if (I.mayHaveSideEffects())
+          continue;
+
+        // a read from memory is only invariant if nothing in the loop may
+        // write the memory it reads
+        if (I.mayReadFromMemory() && !isMemoryInvariant(&I, AA, Mem))
+          continue;
+
+        // check whether all operands are loop invariant (out of loop,
+        // constants, or invariant themselves)
+        bool AllInvariant = true;
+        for (Value *Op : I.operands()) {
+          auto *OpI = dyn_cast<Instruction>(Op);
+          if (OpI && L->contains(OpI) && !Invariant.count(OpI)) {
+            AllInvariant = false;
+            break;
+          }
         }
+        if (AllInvariant)
+          Invariant.insert(&I);
       }
-      // Constants or values defined outside the loop are acceptable
     }
+  }
 
+  LoopMemory analyzeMemory(Loop *L) {
+    LoopMemory Mem;
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (I.mayWriteToMemory())
+          Mem.Writers.push_back(&I);
+        if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+          Mem.MayThrow = true;
+      }
+    }
+    return Mem;
+  }
+
+  // A simple load or a readonly call whose memory no writer in the loop
+  // may modify reads the same value in every iteration.
+  bool isMemoryInvariant(Instruction *I, AAResults &AA,
+                         const LoopMemory &Mem) {
+    if (auto *LI = dyn_cast<LoadInst>(I)) {
+      if (!LI->isSimple())
+        return false;
+      MemoryLocation Loc = MemoryLocation::get(LI);
+      for (Instruction *W : Mem.Writers)
+        if (isModSet(AA.getModRefInfo(W, Loc)))
+          return false;
+      return true;
+    }
+    if (auto *CI = dyn_cast<CallInst>(I)) {
+      if (!CI->onlyReadsMemory())
+        return false;
+      for (Instruction *W : Mem.Writers)
+        if (isModOrRefSet(AA.getModRefInfo(W, CI)))
+          return false;
+      return true;
+    }
+    return false;
+  }
+
+  // I runs in every iteration that completes: nothing in the loop may
+  // throw or not return, and its block dominates every exiting block.
+  bool isGuaranteedToExecute(Instruction *I, Loop *L, DominatorTree &DT,
+                             const LoopMemory &Mem) {
+    if (Mem.MayThrow)
+      return false;
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    if (Exiting.empty())
+      return false;
+    for (BasicBlock *E : Exiting)
+      if (!DT.dominates(I->getParent(), E))
+        return false;
     return true;
   }
 
   // Check whether the instruction can be safely hoisted
-  bool isSafeToHoist(Instruction *I, Loop *L) {
+  bool isSafeToHoist(Instruction *I, Loop *L, DominatorTree &DT,
+                     const LoopMemory &Mem) {
     // Cannot hoist instructions with side effects
     if (I->mayHaveSideEffects())
       return false;
 
-    // Cannot hoist memory access instructions (load/store)
-    else if (isa<LoadInst>(I) || isa<StoreInst>(I))
-      return false;
-
-    // Cannot hoist call instructions
-    else if (isa<CallInst>(I))
-      return false;
     // Cannot hoist terminator instructions
     else if (I->isTerminator())
       return false;
-    return true;
+
+    // The preheader runs I even when the loop would not have, so I must
+    // run in every iteration anyway, or be unable to trap (a division by
+    // zero, a load from an invalid pointer, ...)
+    return isGuaranteedToExecute(I, L, DT, Mem) ||
+           isSafeToSpeculativelyExecute(I);
   }
 
-public:
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
-    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
-    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+  // Division and remainder are expensive, but trap on operands the loop
+  // might never have divided by. They can still be hoisted under a guard.
+  bool canHoistGuarded(Instruction *I) {
+    switch (I->getOpcode()) {
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+      return I->getType()->isIntegerTy();
+    default:
+      return false;
+    }
+  }
 
-    bool Changed = false;
+  // Hoist I into a block between the preheader and the loop that only runs
+  // when the operands cannot trap:
+  //
+  //   preheader: %safe = ...
+  //              br i1 %safe, label %guard, label %tail
+  //   guard:     %q = sdiv i32 %a, %b
+  //   tail:      %q.hoisted = phi i32 [ %q, %guard ], [ poison, %preheader ]
+  //
+  // Whenever the loop runs I, its operands are safe, so the PHI has the
+  // value of I there. The tail block becomes the new preheader.
+  void hoistGuarded(Instruction *I, Loop *L, DominatorTree &DT,
+                    LoopInfo &LI) {
+    BasicBlock *Preheader = L->getLoopPreheader();
+    Instruction *Term = Preheader->getTerminator();
+    Value *Dividend = I->getOperand(0);
+    Value *Divisor = I->getOperand(1);
+    Type *Ty = I->getType();
+
+    IRBuilder<> Builder(Term);
+    // The loop may never have reached I, so undef or poison operands were
+    // harmless there, but branching on them before the loop is not. The
+    // operands are frozen, and I divides the frozen values, so the guard
+    // and the division agree.
+    auto Freeze = [&](Value *V) -> Value * {
+      if (isGuaranteedNotToBeUndefOrPoison(V, nullptr, Term, &DT))
+        return V;
+      return Builder.CreateFreeze(V, V->getName() + ".fr");
+    };
+    Divisor = Freeze(Divisor);
+    I->setOperand(1, Divisor);
+    if (I->getOpcode() == Instruction::SDiv ||
+        I->getOpcode() == Instruction::SRem) {
+      Dividend = Freeze(Dividend);
+      I->setOperand(0, Dividend);
+    }
+
+    Value *Safe = Builder.CreateICmpNE(Divisor, Constant::getNullValue(Ty));
+    if (I->getOpcode() == Instruction::SDiv ||
+        I->getOpcode() == Instruction::SRem) {
+      // INT_MIN / -1 overflows
+      APInt SignedMin = APInt::getSignedMinValue(Ty->getIntegerBitWidth());
+      Value *NoOverflow = Builder.CreateOr(
+          Builder.CreateICmpNE(Dividend, ConstantInt::get(Ty, SignedMin)),
+          Builder.CreateICmpNE(Divisor, Constant::getAllOnesValue(Ty)));
+      Safe = Builder.CreateAnd(Safe, NoOverflow);
+    }
+    Safe->setName(I->getName() + ".safe");
+
+    DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+    Instruction *GuardTerm =
+        SplitBlockAndInsertIfThen(Safe, Term, false, nullptr, &DTU, &LI);
+    BasicBlock *Tail = Term->getParent();
+    GuardTerm->getParent()->setName(I->getName() + ".guard");
+    Tail->setName(Preheader->getName() + ".guarded");
+    I->moveBefore(GuardTerm->getIterator());
+
+    IRBuilder<> TailBuilder(Tail, Tail->begin());
+    PHINode *PN = TailBuilder.CreatePHI(Ty, 2, I->getName() + ".hoisted");
+    I->replaceAllUsesWith(PN);
+    PN->addIncoming(I, GuardTerm->getParent());
+    PN->addIncoming(PoisonValue::get(Ty), Preheader);
+  }
 
-    // Traverse all loops (process nested loops from inner to outer)
-    std::vector<Loop *> Loops;
-    for (auto *L : LI) {
-      for (auto *SubL : L->getSubLoops()) {
-        Loops.push_back(SubL);
+  // Scalar promotion: a location that is only accessed in the loop by
+  // simple loads and stores through one invariant pointer, and that nothing
+  // else in the loop may access, is kept in a register. It is loaded once
+  // in the preheader and stored back in every exit block. A store to it
+  // must run in every iteration, so neither the preheader load nor the exit
+  // stores touch memory the loop would not have touched.
+  bool promoteScalars(Loop *L, AAResults &AA, DominatorTree &DT,
+                      const LoopMemory &Mem) {
+    BasicBlock *Preheader = L->getLoopPreheader();
+    if (!Preheader || Mem.MayThrow || !L->hasDedicatedExits())
+      return false;
+
+    MapVector<Value *, SmallVector<Instruction *, 4>> Accesses;
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        Value *Ptr = nullptr;
+        if (auto *LI = dyn_cast<LoadInst>(&I))
+          Ptr = LI->isSimple() ? LI->getPointerOperand() : nullptr;
+        else if (auto *SI = dyn_cast<StoreInst>(&I))
+          Ptr = SI->isSimple() ? SI->getPointerOperand() : nullptr;
+        auto *PtrI = dyn_cast_or_null<Instruction>(Ptr);
+        if (Ptr && !(PtrI && L->contains(PtrI)))
+          Accesses[Ptr].push_back(&I);
       }
-      Loops.push_back(L);
     }
 
-    for (Loop *L : Loops) {
-      BasicBlock *Preheader = L->getLoopPreheader();
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
 
-      // Skip if there is no preheader
-      if (!Preheader)
+    bool Changed = false;
+    for (auto &Entry : Accesses) {
+      Value *Ptr = Entry.first;
+      SmallVectorImpl<Instruction *> &Insts = Entry.second;
+
+      // all accesses have one type, and a store of it runs every iteration
+      Type *Ty = getLoadStoreType(Insts.front());
+      StoreInst *Anchor = nullptr;
+      bool SameType = true;
+      for (Instruction *I : Insts) {
+        SameType &= getLoadStoreType(I) == Ty;
+        auto *SI = dyn_cast<StoreInst>(I);
+        if (SI && !Anchor && isGuaranteedToExecute(SI, L, DT, Mem))
+          Anchor = SI;
+      }
+      if (!SameType || !Anchor)
         continue;
 
-      Instruction *InsertPoint = Preheader->getTerminator();
-
-      // Traverse all basic blocks in the loop
-      std::vector<BasicBlock *> BlocksToProcess(L->blocks().begin(),
-                                                L->blocks().end());
-
-      for (BasicBlock *BB : BlocksToProcess) {
-        // Use iterator to traverse instructions, as the instruction sequence
-        // may be modified
-        for (auto It = BB->begin(); It != BB->end();) {
-          Instruction *I = &*It++;
-
-          // Check if the instruction is loop-invariant and safe to hoist
-          if (isLoopInvariant(I, L, DT) && isSafeToHoist(I, L)) {
-            // Check if all uses are within the loop
-            // maybe that is used for the PHI [I, loop] node outside the loop?
-
-            bool AllUsesInLoop = true;
-            for (User *U : I->users()) {
-              if (auto *UI = dyn_cast<Instruction>(U)) {
-                if (!L->contains(UI)) {
-                  AllUsesInLoop = false;
-                  break;
-                }
-              }
-            }
+      // nothing else in the loop may read or write the location
+      MemoryLocation Loc = MemoryLocation::get(Anchor);
+      SmallPtrSet<Instruction *, 8> Promoted(Insts.begin(), Insts.end());
+      bool Aliased = false;
+      for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+          if (!I.mayReadOrWriteMemory() || Promoted.count(&I))
+            continue;
+          if (isModOrRefSet(AA.getModRefInfo(&I, Loc))) {
+            Aliased = true;
+            break;
+          }
+        }
+        if (Aliased)
+          break;
+      }
+      if (Aliased)
+        continue;
+
+      errs() << "LICM: Promoting " << *Ptr << " to a register\n";
+      SmallVector<const Instruction *, 4> ConstInsts(Insts.begin(),
+                                                     Insts.end());
+      SSAUpdater SSA;
+      ScalarPromoter Promoter(ConstInsts, SSA, Ptr, ExitBlocks,
+                              Anchor->getAlign());
+      IRBuilder<> Builder(Preheader->getTerminator());
+      LoadInst *Initial = Builder.CreateAlignedLoad(
+          Ty, Ptr, Anchor->getAlign(), Ptr->getName() + ".promoted");
+      SSA.AddAvailableValue(Preheader, Initial);
+      Promoter.run(Insts);
+      if (Initial->use_empty())
+        Initial->eraseFromParent();
+      Changed = true;
+    }
+    return Changed;
+  }
+
+  // Sinking: an instruction whose value is only used after the loop is
+  // computed once in the exit blocks instead of in every iteration.
+  bool isSinkable(Instruction *I, AAResults &AA, const LoopMemory &Mem) {
+    if (isa<PHINode>(I) || I->isTerminator() || isa<AllocaInst>(I) ||
+        I->mayHaveSideEffects())
+      return false;
+    // a read must see the same memory after the loop
+    return !I->mayReadFromMemory() || isMemoryInvariant(I, AA, Mem);
+  }
+
+  // Collect the users of I if all of them are LCSSA PHIs of I in exit
+  // blocks of L.
+  bool getExitPHIUsers(Instruction *I, Loop *L,
+                       SmallVectorImpl<PHINode *> &PHIs) {
+    for (User *U : I->users()) {
+      auto *PN = dyn_cast<PHINode>(U);
+      if (!PN || L->contains(PN))
+        return false;
+      for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i)
+        if (PN->getIncomingValue(i) != I ||
+            !L->contains(PN->getIncomingBlock(i)))
+          return false;
+      PHIs.push_back(PN);
+    }
+    return !PHIs.empty();
+  }
+
+  // The LCSSA PHI of V in Exit, created if there is none yet.
+  PHINode *getLCSSAPHI(Instruction *V, BasicBlock *Exit) {
+    for (PHINode &PN : Exit->phis())
+      if (PN.getType() == V->getType() &&
+          all_of(PN.incoming_values(), [&](Value *In) { return In == V; }))
+        return &PN;
+    IRBuilder<> Builder(Exit, Exit->begin());
+    PHINode *PN = Builder.CreatePHI(V->getType(), pred_size(Exit),
+                                    V->getName() + ".lcssa");
+    for (BasicBlock *Pred : predecessors(Exit))
+      PN->addIncoming(V, Pred);
+    return PN;
+  }
+
+  // Replace each exit PHI of I by a copy of I in its exit block. Operands
+  // defined in the loop reach the copy through LCSSA PHIs, which makes
+  // them candidates for sinking in turn.
+  void sinkToExits(Instruction *I, Loop *L, ArrayRef<PHINode *> PHIs) {
+    Instruction *First = nullptr;
+    for (PHINode *PN : PHIs) {
+      BasicBlock *Exit = PN->getParent();
+      Instruction *Copy = I->clone();
+      for (unsigned i = 0, e = Copy->getNumOperands(); i != e; ++i) {
+        auto *OpI = dyn_cast<Instruction>(Copy->getOperand(i));
+        if (OpI && L->contains(OpI))
+          Copy->setOperand(i, getLCSSAPHI(OpI, Exit));
+      }
+      IRBuilder<> Builder(Exit, Exit->getFirstInsertionPt());
+      Builder.Insert(Copy);
+      if (First)
+        Copy->setName(First->getName());
+      else
+        Copy->takeName(I);
+      First = First ? First : Copy;
+      PN->replaceAllUsesWith(Copy);
+      PN->eraseFromParent();
+    }
+    I->eraseFromParent();
+  }
+
+  bool sinkInstructions(Loop *L, LoopInfo &LI, DominatorTree &DT,
+                        AAResults &AA, const LoopMemory &Mem) {
+    if (!L->hasDedicatedExits())
+      return false;
+
+    // Leave the loop alone unless something may sink: that needs LCSSA
+    bool HasCandidate = false;
+    for (BasicBlock *BB : L->blocks())
+      for (Instruction &I : *BB)
+        if (!HasCandidate && isSinkable(&I, AA, Mem))
+          for (User *U : I.users())
+            if (!L->contains(cast<Instruction>(U)))
+              HasCandidate = true;
+    if (!HasCandidate)
+      return false;
+    bool Changed = formLCSSARecursively(*L, DT, &LI, nullptr);
 
-            // Only hoist if all uses are within the loop
-            if (AllUsesInLoop) {
-              I->moveBefore(InsertPoint->getIterator());
-              Changed = true;
-              errs() << "LICM: Hoisting instruction: " << *I << "\n";
+    // Walk the loop bottom-up, so the users in a chain sink before the
+    // instructions they use
+    LoopBlocksRPO RPOT(L);
+    RPOT.perform(&LI);
+    SmallVector<BasicBlock *, 16> Blocks(RPOT.begin(), RPOT.end());
+    for (BasicBlock *BB : reverse(Blocks)) {
+      for (Instruction &I : make_early_inc_range(reverse(*BB))) {
+        SmallVector<PHINode *, 2> PHIs;
+        if (!isSinkable(&I, AA, Mem) || !getExitPHIUsers(&I, L, PHIs))
+          continue;
+        errs() << "LICM: Sinking instruction: " << I << "\n";
+        sinkToExits(&I, L, PHIs);
+        Changed = true;
+      }
+    }
+    return Changed;
+  }
+
+  // Hoist, promote and sink in one loop. Its inner loops have been
+  // processed already.
+  bool runOnLoop(Loop *L, LoopInfo &LI, DominatorTree &DT, AAResults &AA) {
+    bool Changed = false;
+    BasicBlock *Preheader = L->getLoopPreheader();
+
+    // LoopSimplify gives every loop a preheader; bail out if it did not run
+    if (!Preheader)
+      return false;
+
+    Instruction *InsertPoint = Preheader->getTerminator();
+
+    LoopMemory Mem = analyzeMemory(L);
+    SmallPtrSet<Instruction *, 16> Invariant;
+    computeInvariants(L, LI, AA, Mem, Invariant);
+
+    // Traverse the loop blocks in the same order, so operands are hoisted
+    // before their users
+    LoopBlocksRPO RPOT(L);
+    RPOT.perform(&LI);
+    for (BasicBlock *BB : RPOT) {
+      // Use iterator to traverse instructions, as the instruction sequence
+      // may be modified
+      for (auto It = BB->begin(); It != BB->end();) {
+        Instruction *I = &*It++;
+
+        // Check if the instruction is loop-invariant and safe to hoist,
+        // or at least to hoist under a guard
+        if (!Invariant.count(I))
+          continue;
+        bool Safe = isSafeToHoist(I, L, DT, Mem);
+        if (!Safe && !canHoistGuarded(I))
+          continue;
+
+        // An invariant operand that stayed in the loop (it is not safe to
+        // hoist, or used outside) keeps I in the loop too
+        bool OperandsOutside = true;
+        for (Value *Op : I->operands()) {
+          auto *OpI = dyn_cast<Instruction>(Op);
+          if (OpI && L->contains(OpI)) {
+            OperandsOutside = false;
+            break;
+          }
+        }
+        if (!OperandsOutside)
+          continue;
+
+        // Check if all uses are within the loop
+        // maybe that is used for the PHI [I, loop] node outside the loop?
+        bool AllUsesInLoop = true;
+        for (User *U : I->users()) {
+          if (auto *UI = dyn_cast<Instruction>(U)) {
+            if (!L->contains(UI)) {
+              AllUsesInLoop = false;
+              break;
             }
           }
         }
+
+        // Only hoist if all uses are within the loop
+        if (AllUsesInLoop && Safe) {
+          I->moveBefore(InsertPoint->getIterator());
+          Changed = true;
+          errs() << "LICM: Hoisting instruction: " << *I << "\n";
+        } else if (AllUsesInLoop) {
+          hoistGuarded(I, L, DT, LI);
+          // the guard moved the preheader
+          InsertPoint = L->getLoopPreheader()->getTerminator();
+          Changed = true;
+          errs() << "LICM: Hoisting instruction under a guard: " << *I
+                 << "\n";
+        }
       }
     }
 
-    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    if (promoteScalars(L, AA, DT, Mem)) {
+      // the promoted stores are gone
+      Mem = analyzeMemory(L);
+      Changed = true;
+    }
+
+    Changed |= sinkInstructions(L, LI, DT, AA, Mem);
+    return Changed;
+  }
+
+  // The instructions of L, which unswitching L duplicates.
+  static unsigned getLoopSize(Loop *L) {
+    unsigned Size = 0;
+    for (BasicBlock *BB : L->blocks())
+      Size += BB->size();
+    return Size;
+  }
+
+  // A conditional branch between two blocks of L on a condition computed
+  // outside of L. Unswitching runs after hoisting, so every condition that
+  // is invariant and safe to compute before the loop is there already.
+  // Loops that may not be duplicated, with an indirectbr or a noduplicate
+  // or convergent call, have none.
+  static BranchInst *findUnswitchCandidate(Loop *L) {
+    if (!L->isSafeToClone())
+      return nullptr;
+    for (BasicBlock *BB : L->blocks())
+      for (Instruction &I : *BB)
+        if (auto *CB = dyn_cast<CallBase>(&I))
+          if (CB->isConvergent())
+            return nullptr;
+    for (BasicBlock *BB : L->blocks()) {
+      auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+      if (!BI || !BI->isConditional() ||
+          BI->getSuccessor(0) == BI->getSuccessor(1))
+        continue;
+      Value *Cond = BI->getCondition();
+      if (isa<Constant>(Cond) || !L->isLoopInvariant(Cond))
+        continue;
+      // an exiting branch would leave a version that is no loop at all
+      if (L->contains(BI->getSuccessor(0)) && L->contains(BI->getSuccessor(1)))
+        return BI;
+    }
+    return nullptr;
+  }
+
+  // Within the version L of an unswitched loop, Cond is known to be Val:
+  // replace it, fold the branches that become constant and drop the blocks
+  // of L that are no longer reachable from its header. When the condition
+  // also decided whether to take the back edge, L may not loop any more; it
+  // is then erased from the loop info and false is returned.
+  static bool foldCondition(Loop *L, Value *Cond, Constant *Val,
+                            LoopInfo &LI) {
+    Cond->replaceUsesWithIf(Val, [&](Use &U) {
+      auto *I = dyn_cast<Instruction>(U.getUser());
+      return I && L->contains(I);
+    });
+    for (BasicBlock *BB : L->blocks())
+      ConstantFoldTerminator(BB);
+
+    SmallPtrSet<BasicBlock *, 16> Live;
+    SmallVector<BasicBlock *, 16> Worklist{L->getHeader()};
+    Live.insert(L->getHeader());
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      for (BasicBlock *Succ : successors(BB))
+        if (L->contains(Succ) && Live.insert(Succ).second)
+          Worklist.push_back(Succ);
+    }
+    SmallVector<BasicBlock *, 8> Dead;
+    for (BasicBlock *BB : L->blocks())
+      if (!Live.count(BB))
+        Dead.push_back(BB);
+    for (BasicBlock *BB : Dead)
+      LI.removeBlock(BB);
+    DeleteDeadBlocks(Dead);
+
+    if (any_of(predecessors(L->getHeader()),
+               [&](BasicBlock *Pred) { return L->contains(Pred); }))
+      return true;
+    LI.erase(L);
+    return false;
+  }
+
+  // Unswitch the innermost loop L on the condition of BI: the condition is
+  // tested once before the loop, which then runs as the original loop when
+  // it is true and as a clone when it is false, each with the condition
+  // folded to a constant. The versions that are still loops are added to
+  // Versions.
+  void unswitchLoop(Loop *L, BranchInst *BI, LoopInfo &LI, DominatorTree &DT,
+                    SmallVectorImpl<Loop *> &Versions) {
+    Function &F = *L->getHeader()->getParent();
+    Value *Cond = BI->getCondition();
+
+    // values leave the loop through PHIs in the exit blocks, which then
+    // only need incoming values from the clone as well
+    formLCSSA(*L, DT, &LI, nullptr);
+
+    // the old preheader tests the condition and branches to the versions
+    BasicBlock *Check = L->getLoopPreheader();
+    SplitBlock(Check, Check->getTerminator(), &DT, &LI);
+    BasicBlock *Preheader = L->getLoopPreheader();
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> Blocks;
+    Loop *Clone = cloneLoopWithPreheader(Preheader, Check, L, VMap, ".us", &LI,
+                                         &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    for (BasicBlock *Exit : Exits) {
+      for (PHINode &PN : Exit->phis()) {
+        for (unsigned i = 0, e = PN.getNumIncomingValues(); i != e; ++i) {
+          BasicBlock *In = PN.getIncomingBlock(i);
+          if (!L->contains(In))
+            continue;
+          Value *V = PN.getIncomingValue(i);
+          Value *Mapped = VMap.lookup(V);
+          PN.addIncoming(Mapped ? Mapped : V, cast<BasicBlock>(VMap[In]));
+        }
+      }
+    }
+
+    // The loop may not have reached the branch, so a poison condition
+    // was harmless there; the test before the loop needs a fixed value.
+    Instruction *Term = Check->getTerminator();
+    IRBuilder<> Builder(Term);
+    Value *Test = Cond;
+    if (!isGuaranteedNotToBeUndefOrPoison(Cond, nullptr, Term, &DT))
+      Test = Builder.CreateFreeze(Cond, Cond->getName() + ".fr");
+    Builder.CreateCondBr(Test, Preheader, cast<BasicBlock>(VMap[Preheader]));
+    Term->eraseFromParent();
+
+    if (foldCondition(L, Cond, ConstantInt::getTrue(Cond->getContext()), LI))
+      Versions.push_back(L);
+    if (foldCondition(Clone, Cond, ConstantInt::getFalse(Cond->getContext()),
+                      LI))
+      Versions.push_back(Clone);
+    DT.recalculate(F);
+  }
+
+  // Unswitch innermost loops on invariant conditions as long as the
+  // duplicated code fits the budget. Both versions of an unswitched loop are
+  // considered again for their remaining invariant branches.
+  bool unswitchLoops(LoopInfo &LI, DominatorTree &DT) {
+    unsigned Budget = Opts.UnswitchBudget;
+    SmallVector<Loop *, 8> Worklist;
+    for (Loop *L : LI.getLoopsInPreorder())
+      if (L->isInnermost())
+        Worklist.push_back(L);
+
+    bool Changed = false;
+    while (!Worklist.empty()) {
+      Loop *L = Worklist.pop_back_val();
+      if (!findUnswitchCandidate(L) || getLoopSize(L) > Budget)
+        continue;
+      // the versions of a loop unswitched before share their exit blocks,
+      // so they are made dedicated again
+      Changed |= simplifyLoop(L, &DT, &LI, nullptr, nullptr, nullptr,
+                              /*PreserveLCSSA=*/false);
+      BranchInst *BI = findUnswitchCandidate(L);
+      unsigned Size = getLoopSize(L);
+      if (!BI || Size > Budget)
+        continue;
+
+      errs() << "LICM: Unswitching loop " << L->getHeader()->getName()
+             << " on " << *BI->getCondition() << "\n";
+      Budget -= Size;
+      unswitchLoop(L, BI, LI, DT, Worklist);
+      Changed = true;
+    }
+    return Changed;
+  }
+
+public:
+  explicit LoopInvariantCodeMotion(LoopInvariantCodeMotionOptions Opts = {})
+      : Opts(Opts) {}
+
+  // Function pass: put every loop into LoopSimplify form, which creates
+  // missing preheaders and dedicated exits, then process the whole loop nest
+  // from inner to outer loops, so that an instruction hoisted into the
+  // preheader of an inner loop is considered again for the loops around it.
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    AAResults &AA = AM.getResult<AAManager>(F);
+
+    bool Changed = false;
+    for (Loop *L : LI)
+      Changed |= simplifyLoop(L, &DT, &LI, nullptr, nullptr, nullptr,
+                              /*PreserveLCSSA=*/false);
+
+    SmallVector<Loop *, 8> Loops = LI.getLoopsInPreorder();
+    std::reverse(Loops.begin(), Loops.end());
+    for (Loop *L : Loops)
+      Changed |= runOnLoop(L, LI, DT, AA);
+
+    if (Opts.Unswitch)
+      Changed |= unswitchLoops(LI, DT);
+
+    if (!Changed)
+      return PreservedAnalyses::all();
+    // the CFG changes, but the loop info and dominator tree are kept up to
+    // date
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    return PA;
+  }
+
+  // Loop pass, for `loop(LoopInvariantCodeMotion)`: the loop pass manager
+  // already provides LoopSimplify and LCSSA form and visits inner loops
+  // first.
+  PreservedAnalyses run(Loop &L, LoopAnalysisManager &,
+                        LoopStandardAnalysisResults &AR, LPMUpdater &) {
+    if (!runOnLoop(&L, AR.LI, AR.DT, AR.AA))
+      return PreservedAnalyses::all();
+    AR.SE.forgetLoop(&L);
+    return getLoopPassPreservedAnalyses();
   }
 };
 
+// Parse `LoopInvariantCodeMotion<opt1;opt2;...>`.
+bool parseOptions(StringRef Name, LoopInvariantCodeMotionOptions &Opts) {
+  if (!Name.consume_front(PASS_NAME "<") || !Name.consume_back(">"))
+    return false;
+  SmallVector<StringRef, 2> Params;
+  Name.split(Params, ';');
+  for (StringRef Param : Params) {
+    if (Param == "unswitch") {
+      Opts.Unswitch = true;
+    } else if (Param.consume_front("unswitch-budget=")) {
+      if (Param.getAsInteger(10, Opts.UnswitchBudget))
+        return false;
+      Opts.Unswitch = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
 } // end anonymous namespace
 
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
@@ -134,6 +773,20 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     FPM.addPass(LoopInvariantCodeMotion());
                     return true;
                   }
+                  LoopInvariantCodeMotionOptions Opts;
+                  if (parseOptions(Name, Opts)) {
+                    FPM.addPass(LoopInvariantCodeMotion(Opts));
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, LoopPassManager &LPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME) {
+                    LPM.addPass(LoopInvariantCodeMotion());
+                    return true;
+                  }
                   return false;
                 });
           }};
@@ -27,8 +27,136 @@ int loop_with_multiple_invariants(int n, int x, int y, int z) {
     return sum;
 }
 
+int triple_nest(int n, int a, int b) {
+    int sum = 0;
+
+    // a * b is hoisted out of all three loops, i + a * b out of the two
+    // inner ones
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++) {
+                int inv = a * b + i;
+                sum += inv;
+            }
+        }
+    }
+
+    return sum;
+}
+
+struct vec {
+    int len;
+    int *data;
+};
+
+int sum_vec(const struct vec *v, int *__restrict out) {
+    int sum = 0;
+
+    // v->len is reloaded by the loop condition; nothing in the loop may
+    // write it, so the load is hoisted
+    for (int i = 0; i < v->len; i++) {
+        out[i] = i;
+        sum += i;
+    }
+
+    return sum;
+}
+
+void accumulate(int *__restrict total, const int *__restrict a, int n) {
+    // *total is loaded and stored in every iteration and nothing else
+    // touches it, so it is kept in a register and stored once after the loop
+    int i = 0;
+    do {
+        *total += a[i];
+        i++;
+    } while (i < n);
+}
+
+int conditional_division(int n, int a, int b, int flag) {
+    int sum = 0;
+
+    // a / b only runs when flag is set; hoisting it unguarded would trap
+    // for b == 0 even if the loop never divides, so it is hoisted under a
+    // b != 0 (and no INT_MIN / -1) guard. a % 7 cannot trap and is hoisted
+    // as is
+    for (int i = 0; i < n; i++) {
+        if (flag)
+            sum += a / b + a % 7;
+    }
+
+    return sum;
+}
+
+int last_value(int n, int a) {
+    int i = 0;
+    int last = 0;
+
+    // last is recomputed every iteration but only read after the loop, so
+    // the whole i * a + 5 chain is sunk into the exit block and runs once
+    do {
+        last = (i * a + 5) ^ i;
+        i++;
+    } while (i < n);
+
+    return last;
+}
+
+int two_entries(int n, int a, int b, int skip_first) {
+    int i;
+    int sum = 0;
+
+    // both arms of the if/else branch straight to the loop header, which
+    // has two entry edges and no preheader; one is created so that a * b
+    // can still be hoisted
+    if (skip_first) {
+        i = 1;
+        goto loop;
+    } else {
+        i = 0;
+        goto loop;
+    }
+loop:
+    if (i < n) {
+        sum += a * b;
+        i++;
+        goto loop;
+    }
+
+    return sum;
+}
+
+int scale(int *data, int n, int mode, int *count) {
+    int sum = 0;
+
+    // mode and count do not change in the loop; with unswitching the loop
+    // is duplicated and each version runs without the two tests
+    for (int i = 0; i < n; i++) {
+        int x = data[i];
+        if (mode)
+            x = x * 3;
+        sum += x;
+        if (count)
+            (*count)++;
+    }
+
+    return sum;
+}
+
 int main() {
     int result1 = loop_invariant_test(100, 5, 3);
     int result2 = loop_with_multiple_invariants(50, 10, 20, 7);
-    return result1 + result2;
+    int result3 = triple_nest(10, 2, 3);
+    int data[4] = {1, 2, 3, 4};
+    int out[4];
+    struct vec v = {4, data};
+    int result4 = sum_vec(&v, out);
+    int total = 0;
+    accumulate(&total, data, 4);
+    int result5 = conditional_division(10, 7, 0, 0);
+    int result6 = last_value(10, 3);
+    int result7 = two_entries(10, 2, 3, 1);
+    int count = 0;
+    int result8 = scale(data, 4, 1, &count);
+    return result1 + result2 + result3 + result4 + total + result5 + result6 +
+           result7 + result8 + count;
 }
@@ -0,0 +1,258 @@
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/LoopIterator.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/UnrollLoop.h>
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+
+// Options of the pass, spelled
+// LoopUnroll<full-threshold=N;partial-threshold=N;max-count=N;full-only>.
+struct LoopUnrollOptions {
+  // size of a fully unrolled loop, in instructions
+  unsigned FullThreshold = 200;
+  // size of a partially unrolled loop body, in instructions
+  unsigned PartialThreshold = 150;
+  // number of copies of the body in a partially unrolled loop
+  unsigned MaxCount = 8;
+  bool Partial = true;
+};
+
+// Unrolling of innermost loops with a constant trip count. A loop is
+// unrolled completely when the copies of its body fit the full threshold,
+// and otherwise by the largest factor that divides the trip count and fits
+// the partial threshold. Run ConstantPropagation and
+// CommonSubexpressionElimination afterwards to simplify the copies.
+class ThePass : public PassInfoMixin<ThePass> {
+private:
+  LoopUnrollOptions Opts;
+
+  // Instructions of L that become constants in every copy of the body when
+  // L is unrolled completely: the header PHIs that start at a constant and
+  // are updated from foldable values, what is computed from them and
+  // constants alone, and the branches on such values. Returns how many of
+  // them count towards the size of L.
+  static unsigned countFoldable(Loop *L, LoopInfo &LI) {
+    BasicBlock *Preheader = L->getLoopPreheader();
+    BasicBlock *Latch = L->getLoopLatch();
+    SmallPtrSet<PHINode *, 8> IVs;
+    for (PHINode &PN : L->getHeader()->phis())
+      if (isa<Constant>(PN.getIncomingValueForBlock(Preheader)))
+        IVs.insert(&PN);
+
+    LoopBlocksRPO RPOT(L);
+    RPOT.perform(&LI);
+    SmallPtrSet<Value *, 32> Foldable;
+    // Assume the candidate PHIs foldable, and drop the ones whose next
+    // value turns out not to be until nothing changes.
+    while (true) {
+      Foldable.clear();
+      Foldable.insert(IVs.begin(), IVs.end());
+      auto IsFoldable = [&](Value *V) {
+        return isa<Constant>(V) || Foldable.count(V);
+      };
+      for (BasicBlock *BB : RPOT) {
+        for (Instruction &I : *BB) {
+          if (auto *BI = dyn_cast<BranchInst>(&I)) {
+            if (BI->isConditional() && IsFoldable(BI->getCondition()))
+              Foldable.insert(BI);
+            continue;
+          }
+          if (isa<PHINode>(&I) || isa<CallBase>(&I) ||
+              I.mayReadOrWriteMemory() || I.mayHaveSideEffects())
+            continue;
+          if (all_of(I.operands(), IsFoldable))
+            Foldable.insert(&I);
+        }
+      }
+
+      SmallVector<PHINode *, 4> Dropped;
+      for (PHINode *PN : IVs)
+        if (!IsFoldable(PN->getIncomingValueForBlock(Latch)))
+          Dropped.push_back(PN);
+      if (Dropped.empty())
+        break;
+      for (PHINode *PN : Dropped)
+        IVs.erase(PN);
+    }
+    return Foldable.size() - IVs.size();
+  }
+
+  // Size of the body of L: every instruction but PHIs, debug info and
+  // unconditional branches, which unrolling merges away.
+  static unsigned getLoopSize(Loop *L) {
+    unsigned Size = 0;
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        auto *BI = dyn_cast<BranchInst>(&I);
+        if (isa<PHINode>(&I) || isa<DbgInfoIntrinsic>(&I) ||
+            (BI && BI->isUnconditional()))
+          continue;
+        ++Size;
+      }
+    }
+    return Size;
+  }
+
+  // The number of copies of L to make, or 0 to leave L alone. TripCount
+  // is the number of times the header runs. A loop that exits from its
+  // latch runs its body as often; a loop that exits earlier, like the
+  // header-exiting loops mem2reg leaves behind, runs its body one time
+  // less, and the last run of the header only leaves the loop. The cost
+  // model and the choice of the factor go by the body iterations, while
+  // full unrolling makes one copy per header run.
+  unsigned getUnrollCount(Loop *L, unsigned TripCount, LoopInfo &LI) {
+    unsigned Iterations =
+        L->isLoopExiting(L->getLoopLatch()) ? TripCount : TripCount - 1;
+    if (!Iterations)
+      return 0;
+
+    unsigned Size = getLoopSize(L);
+    // in a fully unrolled loop, the foldable instructions cost nothing
+    uint64_t FullSize = (uint64_t)(Size - countFoldable(L, LI)) * Iterations;
+    if (FullSize <= Opts.FullThreshold) {
+      errs() << "Unroll: fully unrolling loop " << L->getHeader()->getName()
+             << " with " << Iterations << " iterations, size " << FullSize
+             << "\n";
+      return TripCount;
+    }
+    if (!Opts.Partial)
+      return 0;
+
+    unsigned Count = std::min(Opts.MaxCount, Iterations / 2);
+    for (; Count >= 2; --Count) {
+      if (Iterations % Count == 0 &&
+          (uint64_t)Size * Count <= Opts.PartialThreshold)
+        break;
+    }
+    if (Count < 2)
+      return 0;
+    errs() << "Unroll: unrolling loop " << L->getHeader()->getName() << " by "
+           << Count << ", size " << Size * Count << "\n";
+    return Count;
+  }
+
+public:
+  explicit ThePass(LoopUnrollOptions Opts = {}) : Opts(Opts) {}
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    AssumptionCache &AC = AM.getResult<AssumptionAnalysis>(F);
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    OptimizationRemarkEmitter &ORE =
+        AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+    // UnrollLoop wants LoopSimplify and LCSSA form
+    bool Changed = false;
+    for (Loop *L : LI) {
+      Changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr,
+                              /*PreserveLCSSA=*/false);
+      Changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+    }
+
+    SmallVector<Loop *, 8> Worklist;
+    for (Loop *L : LI.getLoopsInPreorder())
+      if (L->isInnermost())
+        Worklist.push_back(L);
+
+    while (!Worklist.empty()) {
+      Loop *L = Worklist.pop_back_val();
+      unsigned TripCount = SE.getSmallConstantTripCount(L);
+      if (!TripCount || !L->isLoopSimplifyForm() || !L->isSafeToClone())
+        continue;
+      unsigned Count = getUnrollCount(L, TripCount, LI);
+      if (!Count)
+        continue;
+
+      Loop *Parent = L->getParentLoop();
+      UnrollLoopOptions ULO = {};
+      ULO.Count = Count;
+      ULO.Force = false;
+      ULO.Runtime = false;
+      ULO.AllowExpensiveTripCount = false;
+      ULO.UnrollRemainder = false;
+      ULO.ForgetAllSCEV = false;
+      LoopUnrollResult Result = UnrollLoop(L, ULO, &LI, &SE, &DT, &AC, &TTI,
+                                           &ORE, /*PreserveLCSSA=*/true);
+      if (Result == LoopUnrollResult::Unmodified)
+        continue;
+      Changed = true;
+      // the loop around a fully unrolled loop may be innermost now
+      if (Result == LoopUnrollResult::FullyUnrolled && Parent &&
+          Parent->isInnermost())
+        Worklist.push_back(Parent);
+    }
+
+    if (!Changed)
+      return PreservedAnalyses::all();
+    // UnrollLoop keeps the dominator tree and loop info up to date
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    return PA;
+  }
+};
+
+// Parse `LoopUnroll<opt1;opt2;...>`.
+bool parseOptions(StringRef Name, LoopUnrollOptions &Opts) {
+  if (!Name.consume_front(PASS_NAME "<") || !Name.consume_back(">"))
+    return false;
+  SmallVector<StringRef, 4> Params;
+  Name.split(Params, ';');
+  for (StringRef Param : Params) {
+    if (Param == "full-only") {
+      Opts.Partial = false;
+    } else if (Param.consume_front("full-threshold=")) {
+      if (Param.getAsInteger(10, Opts.FullThreshold))
+        return false;
+    } else if (Param.consume_front("partial-threshold=")) {
+      if (Param.getAsInteger(10, Opts.PartialThreshold))
+        return false;
+    } else if (Param.consume_front("max-count=")) {
+      if (Param.getAsInteger(10, Opts.MaxCount))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+} // end anonymous namespace
+
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, PASS_NAME_EXT, LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME) {
+                    FPM.addPass(ThePass());
+                    return true;
+                  }
+                  LoopUnrollOptions Opts;
+                  if (parseOptions(Name, Opts)) {
+                    FPM.addPass(ThePass(Opts));
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
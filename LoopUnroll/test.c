@@ -0,0 +1,43 @@
+// Test cases for the loop unrolling pass
+
+int dot3(int *a, int *b) {
+  // three iterations: unrolled completely, the indices become constants
+  int s = 0;
+  for (int i = 0; i < 3; i++)
+    s += a[i] * b[i];
+  return s;
+}
+
+int weights(int *a) {
+  // i * i and i + 1 fold to constants in every copy, so they do not count
+  // towards the size of the unrolled loop
+  int s = 0;
+  for (int i = 0; i < 8; i++)
+    s += a[i] * (i * i + 1);
+  return s;
+}
+
+int sum(int *a) {
+  // too many iterations to unroll completely; unrolled by 8, which
+  // divides the 1000 iterations and keeps the body within the threshold
+  int s = 0;
+  for (int i = 0; i < 1000; i++)
+    s += a[i];
+  return s;
+}
+
+void grid(int *a) {
+  // the inner loop is unrolled completely, then the outer one
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 3; j++)
+      a[i * 3 + j] = i + j;
+}
+
+int main(void) {
+  int a[1000];
+  int b[3] = {1, 2, 3};
+  for (int i = 0; i < 1000; i++)
+    a[i] = i;
+  grid(a);
+  return dot3(a, b) + weights(a) + sum(a);
+}
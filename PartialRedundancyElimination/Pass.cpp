@@ -0,0 +1,277 @@
+#include "Common/InstKey.h"
+
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Local.h>
+
+#include <unordered_map>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+// Partial redundancy elimination in the style of GVN-PRE. An expression
+// that is already computed on some of the incoming paths of a block is
+// computed on the remaining path as well, after which the occurrence in the
+// block is fully redundant and becomes a PHI of the incoming values.
+// Fully redundant expressions (an equal one dominates) are replaced
+// directly, so the pass subsumes global CSE, and an expression computed
+// in the preheader and again around the loop is merged into a PHI in the
+// header.
+class ThePass : public PassInfoMixin<ThePass> {
+private:
+  // Only side-effect free computations whose result depends on nothing but
+  // their operands take part.
+  static bool isCandidate(Instruction &I) {
+    return isa<BinaryOperator>(&I) || isa<UnaryOperator>(&I) ||
+           isa<CmpInst>(&I) || isa<CastInst>(&I) ||
+           isa<GetElementPtrInst>(&I) || isa<SelectInst>(&I) ||
+           isa<ExtractValueInst>(&I) || isa<InsertValueInst>(&I) ||
+           isa<ExtractElementInst>(&I) || isa<InsertElementInst>(&I) ||
+           isa<ShuffleVectorInst>(&I);
+  }
+
+  // Every candidate instruction of the function, by expression, with the
+  // same notion of equivalence as in the CSE pass (Common/InstKey.h). The
+  // stored keys, and those built for lookups, live in the arena until the
+  // end of the round.
+  struct ExprMap {
+    std::unordered_map<InstKey, SmallVector<Instruction *, 2>, InstKeyHash>
+        Insts;
+    BumpPtrAllocator Arena;
+
+    // The key of I as if its operands were Ops.
+    InstKey makeKey(Instruction *I, ArrayRef<Value *> Ops) {
+      SmallVector<Value *, 4> KeyOps(Ops.begin(), Ops.end());
+      SmallVector<int, 4> Imms;
+      return copyInstKey(makeInstKey(I, KeyOps, Imms), Arena);
+    }
+
+    InstKey makeKey(Instruction *I) {
+      SmallVector<Value *, 4> Ops(I->op_begin(), I->op_end());
+      return makeKey(I, Ops);
+    }
+
+    void add(const InstKey &K, Instruction *I) { Insts[K].push_back(I); }
+
+    void forget(const InstKey &K, Instruction *I) {
+      auto It = Insts.find(K);
+      if (It == Insts.end())
+        return;
+      auto &List = It->second;
+      List.erase(std::remove(List.begin(), List.end(), I), List.end());
+    }
+
+    // Replace I by V. The keys of the users of I name I as an operand, so
+    // the users are taken out before and put back under their new keys;
+    // no stored key may keep naming I once it is deleted.
+    void replace(Instruction *I, Value *V) {
+      SmallVector<Instruction *, 8> Users;
+      for (User *U : I->users()) {
+        auto *UI = cast<Instruction>(U);
+        if (isCandidate(*UI) && !is_contained(Users, UI)) {
+          forget(makeKey(UI), UI);
+          Users.push_back(UI);
+        }
+      }
+      I->replaceAllUsesWith(V);
+      for (Instruction *UI : Users)
+        add(makeKey(UI), UI);
+    }
+  };
+
+  // An instruction computing K whose value is available at the end of BB,
+  // other than Except.
+  static Instruction *findAvailable(ExprMap &Exprs, const InstKey &K,
+                                    BasicBlock *BB, Instruction *Except,
+                                    DominatorTree &DT) {
+    auto It = Exprs.Insts.find(K);
+    if (It == Exprs.Insts.end())
+      return nullptr;
+    for (Instruction *J : It->second)
+      if (J != Except && DT.dominates(J, BB->getTerminator()))
+        return J;
+    return nullptr;
+  }
+
+  // Prev now stands for I as well: keep only the flags both of them have.
+  static void mergeInto(Instruction *Prev, Instruction *I) {
+    if (Prev->getOpcode() != I->getOpcode())
+      return;
+    Prev->andIRFlags(I);
+    combineMetadataForCSE(Prev, I, /*DoesKMove=*/false);
+  }
+
+  // Try to make I fully redundant by computing it on the one incoming edge
+  // where it is missing, then replace it by a PHI of the incoming values.
+  bool tryPRE(Instruction *I, ExprMap &Exprs, DominatorTree &DT) {
+    BasicBlock *BB = I->getParent();
+    SmallVector<BasicBlock *, 4> Preds;
+    for (BasicBlock *P : predecessors(BB)) {
+      if (!DT.isReachableFromEntry(P))
+        return false;
+      if (!is_contained(Preds, P))
+        Preds.push_back(P);
+    }
+    if (Preds.size() < 2)
+      return false;
+
+    // the operands of I seen from each predecessor
+    for (Use &U : I->operands())
+      if (auto *OpI = dyn_cast<Instruction>(U.get()))
+        if (OpI->getParent() == BB && !isa<PHINode>(OpI))
+          return false;
+
+    DenseMap<BasicBlock *, Value *> Incoming;
+    BasicBlock *Missing = nullptr;
+    SmallVector<Value *, 4> MissingOps;
+    for (BasicBlock *P : Preds) {
+      SmallVector<Value *, 4> Ops;
+      for (Use &U : I->operands()) {
+        auto *PN = dyn_cast<PHINode>(U.get());
+        Ops.push_back(PN && PN->getParent() == BB
+                          ? PN->getIncomingValueForBlock(P)
+                          : U.get());
+      }
+      if (Instruction *J = findAvailable(Exprs, Exprs.makeKey(I, Ops), P, I, DT)) {
+        Incoming[P] = J;
+        continue;
+      }
+      // only one insertion per expression, so no path gets longer
+      if (Missing)
+        return false;
+      Missing = P;
+      MissingOps = Ops;
+    }
+
+    if (Missing) {
+      // the computation now also runs on paths that did not execute it
+      if (!isSafeToSpeculativelyExecute(I))
+        return false;
+      // a critical edge gets its own block to hold the computation
+      if (Missing->getTerminator()->getNumSuccessors() > 1) {
+        if (count(predecessors(BB), Missing) > 1)
+          return false;
+        unsigned SuccNum = GetSuccessorNumber(Missing, BB);
+        BasicBlock *Split =
+            SplitCriticalEdge(Missing->getTerminator(), SuccNum,
+                              CriticalEdgeSplittingOptions(&DT));
+        if (!Split)
+          return false;
+        Missing = Split;
+      }
+      Instruction *Clone = I->clone();
+      for (unsigned i = 0, e = MissingOps.size(); i != e; ++i)
+        Clone->setOperand(i, MissingOps[i]);
+      IRBuilder<> Builder(Missing->getTerminator());
+      Builder.Insert(Clone, I->getName() + ".pre");
+      Exprs.add(Exprs.makeKey(Clone), Clone);
+      Incoming[Missing] = Clone;
+      errs() << "PRE: inserted " << *Clone << " in " << Missing->getName()
+             << "\n";
+    }
+
+    IRBuilder<> Builder(BB, BB->begin());
+    PHINode *PN = Builder.CreatePHI(I->getType(), Preds.size(),
+                                    I->getName() + ".merged");
+    for (BasicBlock *P : predecessors(BB)) {
+      auto *J = cast<Instruction>(Incoming[P]);
+      if (J != Incoming.lookup(Missing))
+        mergeInto(J, I);
+      PN->addIncoming(J, P);
+    }
+    errs() << "PRE: replaced " << *I << " with " << *PN << "\n";
+    Exprs.add(Exprs.makeKey(I), PN);
+    Exprs.replace(I, PN);
+    return true;
+  }
+
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    bool Changed = false;
+
+    // An expression made available by one round may make another one
+    // partially redundant, as around a loop, so repeat a few times.
+    const unsigned MaxRounds = 4;
+    for (unsigned Round = 0; Round != MaxRounds; ++Round) {
+      ExprMap Exprs;
+      for (BasicBlock &BB : F)
+        for (Instruction &I : BB)
+          if (isCandidate(I))
+            Exprs.add(Exprs.makeKey(&I), &I);
+
+      bool RoundChanged = false;
+      ReversePostOrderTraversal<Function *> RPOT(&F);
+      for (BasicBlock *BB : RPOT) {
+        for (Instruction &I : make_early_inc_range(*BB)) {
+          if (!isCandidate(I))
+            continue;
+          InstKey K = Exprs.makeKey(&I);
+          bool Replaced = false;
+
+          // fully redundant: an equal expression dominates I
+          Instruction *Dom = nullptr;
+          for (Instruction *J : Exprs.Insts[K]) {
+            if (J != &I && DT.dominates(J, &I)) {
+              Dom = J;
+              break;
+            }
+          }
+          if (Dom) {
+            mergeInto(Dom, &I);
+            errs() << "PRE: replaced " << I << " with " << *Dom << "\n";
+            Exprs.replace(&I, Dom);
+            Replaced = true;
+          } else {
+            Replaced = tryPRE(&I, Exprs, DT);
+          }
+
+          if (Replaced) {
+            Exprs.forget(K, &I);
+            I.eraseFromParent();
+            RoundChanged = true;
+          }
+        }
+      }
+      if (!RoundChanged)
+        break;
+      Changed = true;
+    }
+
+    if (!Changed)
+      return PreservedAnalyses::all();
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    return PA;
+  }
+};
+} // end anonymous namespace
+
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, PASS_NAME_EXT, LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME) {
+                    FPM.addPass(ThePass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
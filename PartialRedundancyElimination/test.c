@@ -0,0 +1,57 @@
+// Test cases for the partial redundancy elimination pass
+
+int if_then(int a, int b, int c) {
+  int r = 0;
+  if (c)
+    r = a + b;
+  // partially redundant: a + b is inserted on the else path and this
+  // becomes a PHI
+  return r + (a + b);
+}
+
+int if_else(int a, int b, int c) {
+  int r;
+  if (c)
+    r = a * b;
+  else
+    r = (b * a) + 1;
+  // redundant on both paths, but neither dominates: a PHI of the two
+  return r + a * b;
+}
+
+int translated(int a, int b, int c) {
+  int x, y;
+  if (c) {
+    x = a;
+    y = a + 1;
+  } else {
+    x = b;
+    y = 0;
+  }
+  // x + 1 is a + 1 on the then path, and b + 1 is inserted on the else path
+  return y + (x + 1);
+}
+
+int division(int a, int b, int c) {
+  int r = 0;
+  if (c)
+    r = a / b;
+  // not changed: a / b may trap, so it is not computed on the else path
+  return r + a / b;
+}
+
+int loop(int a, int b, int n) {
+  int s = a + b;
+  for (int i = 0; i < n; i++)
+    s += a + b; // fully redundant with the computation before the loop
+  return s;
+}
+
+int main(void) {
+  int r = if_then(1, 2, 1);
+  r += if_else(1, 2, 0);
+  r += translated(1, 2, 1);
+  r += division(6, 3, 1);
+  r += loop(1, 2, 10);
+  return r;
+}
@@ -0,0 +1,232 @@
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/Analysis/ConstantFolding.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Local.h>
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+
+// Reassociation of associative and commutative expression trees. A tree of
+// one opcode (add, mul, and, or, xor, and fadd/fmul under reassoc and nsz)
+// is flattened into its leaves, the constant leaves are folded into one,
+// and the tree is rebuilt as a left-leaning chain with the leaves sorted by
+// rank and the constant last:
+//
+//   (a + 1) + b + 2  and  a + (b + 3)  both become  (a + b) + 3
+//
+// Values defined earlier have lower ranks, so expressions over the same
+// values share their prefix, which the CSE pass then merges.
+class ThePass : public PassInfoMixin<ThePass> {
+private:
+  // Rank of a leaf: constants 0, arguments by position, instructions by
+  // their position in reverse post-order.
+  DenseMap<Value *, unsigned> Rank;
+
+  unsigned getRank(Value *V) {
+    if (isa<Constant>(V))
+      return 0;
+    auto It = Rank.find(V);
+    // values not ranked up front come from outside the function
+    return It == Rank.end() ? 0 : It->second;
+  }
+
+  static bool isReassociable(Instruction *I, unsigned Opcode) {
+    if (I->getOpcode() != Opcode)
+      return false;
+    switch (Opcode) {
+    case Instruction::Add:
+    case Instruction::Mul:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      return true;
+    case Instruction::FAdd:
+    case Instruction::FMul:
+      return I->hasAllowReassoc() && I->hasNoSignedZeros();
+    default:
+      return false;
+    }
+  }
+
+  // Identity element of Opcode. Trees of fadd have nsz, so +0.0 is one.
+  static Constant *getIdentity(unsigned Opcode, Type *Ty) {
+    if (Opcode == Instruction::FAdd)
+      return Constant::getNullValue(Ty);
+    return ConstantExpr::getBinOpIdentity(Opcode, Ty);
+  }
+
+  // A node belongs to the tree of its user if it has no other user and
+  // sits in the same block, so rebuilding the tree moves nothing.
+  static bool isInterior(Value *V, unsigned Opcode, BasicBlock *BB) {
+    auto *I = dyn_cast<Instruction>(V);
+    return I && I->hasOneUse() && I->getParent() == BB &&
+           isReassociable(I, Opcode);
+  }
+
+  // A root is a reassociable node that is not interior to another tree.
+  static bool isRoot(Instruction *I) {
+    if (!isa<BinaryOperator>(I) || !isReassociable(I, I->getOpcode()))
+      return false;
+    if (!I->hasOneUse())
+      return true;
+    auto *User = cast<Instruction>(*I->user_begin());
+    return !(User->getParent() == I->getParent() &&
+             isReassociable(User, I->getOpcode()));
+  }
+
+  static void collectLeaves(Instruction *Root, SmallVectorImpl<Value *> &Leaves,
+                            FastMathFlags &FMF) {
+    SmallVector<Instruction *, 8> Worklist{Root};
+    while (!Worklist.empty()) {
+      Instruction *I = Worklist.pop_back_val();
+      if (isa<FPMathOperator>(I))
+        FMF &= I->getFastMathFlags();
+      for (Value *Op : I->operands()) {
+        if (isInterior(Op, Root->getOpcode(), Root->getParent()))
+          Worklist.push_back(cast<Instruction>(Op));
+        else
+          Leaves.push_back(Op);
+      }
+    }
+  }
+
+  // Is Root already the chain ((L0 op L1) op L2) ... op Ln-1?
+  static bool isChainOf(Instruction *Root, ArrayRef<Value *> Leaves) {
+    Value *V = Root;
+    for (size_t i = Leaves.size() - 1; i != 0; --i) {
+      auto *I = dyn_cast<Instruction>(V);
+      if (!I || I->getOpcode() != Root->getOpcode() ||
+          I->getOperand(1) != Leaves[i])
+        return false;
+      if (I != Root && !isInterior(I, Root->getOpcode(), Root->getParent()))
+        return false;
+      V = I->getOperand(0);
+    }
+    return V == Leaves[0];
+  }
+
+  // Flatten the tree at Root and rebuild it in canonical form.
+  bool reassociate(Instruction *Root, const DataLayout &DL) {
+    unsigned Opcode = Root->getOpcode();
+    Type *Ty = Root->getType();
+    SmallVector<Value *, 8> Leaves;
+    FastMathFlags FMF;
+    FMF.set();
+    collectLeaves(Root, Leaves, FMF);
+    size_t NumLeaves = Leaves.size();
+
+    // fold the constant leaves into one
+    Constant *C = nullptr;
+    SmallVector<Value *, 8> Vars;
+    for (Value *Leaf : Leaves) {
+      auto *LC = dyn_cast<Constant>(Leaf);
+      if (!LC) {
+        Vars.push_back(Leaf);
+        continue;
+      }
+      Constant *Folded = C ? ConstantFoldBinaryOpOperands(Opcode, C, LC, DL)
+                           : LC;
+      if (!Folded)
+        return false;
+      C = Folded;
+    }
+
+    // the same value twice: x & x = x, x | x = x, x ^ x = 0
+    llvm::stable_sort(Vars, [&](Value *A, Value *B) {
+      return getRank(A) < getRank(B);
+    });
+    if (Opcode == Instruction::And || Opcode == Instruction::Or) {
+      Vars.erase(std::unique(Vars.begin(), Vars.end()), Vars.end());
+    } else if (Opcode == Instruction::Xor) {
+      SmallVector<Value *, 8> Kept;
+      for (Value *V : Vars) {
+        if (!Kept.empty() && Kept.back() == V)
+          Kept.pop_back();
+        else
+          Kept.push_back(V);
+      }
+      Vars.swap(Kept);
+    }
+
+    if (C) {
+      if (C == ConstantExpr::getBinOpAbsorber(Opcode, Ty))
+        Vars.clear();
+      else if (C == getIdentity(Opcode, Ty))
+        C = nullptr;
+    }
+    if (C)
+      Vars.push_back(C);
+    if (Vars.empty())
+      Vars.push_back(C ? C : getIdentity(Opcode, Ty));
+
+    if (Vars.size() == NumLeaves && isChainOf(Root, Vars))
+      return false;
+
+    errs() << "Reassociate: rewrote " << *Root;
+    Value *New = Vars[0];
+    if (Vars.size() > 1) {
+      IRBuilder<> Builder(Root);
+      if (isa<FPMathOperator>(Root))
+        Builder.setFastMathFlags(FMF);
+      for (size_t i = 1, e = Vars.size(); i != e; ++i) {
+        // nsw/nuw do not survive reassociation, so none are set
+        New = Builder.CreateBinOp((Instruction::BinaryOps)Opcode, New,
+                                  Vars[i]);
+      }
+      New->takeName(Root);
+      Rank[New] = getRank(Root);
+    }
+    errs() << " as " << *New << "\n";
+    Root->replaceAllUsesWith(New);
+    RecursivelyDeleteTriviallyDeadInstructions(
+        Root, nullptr, nullptr, [&](Value *V) { Rank.erase(V); });
+    return true;
+  }
+
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+    Rank.clear();
+    unsigned NextRank = 1;
+    for (Argument &A : F.args())
+      Rank[&A] = NextRank++;
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    for (BasicBlock *BB : RPOT)
+      for (Instruction &I : *BB)
+        Rank[&I] = NextRank++;
+
+    bool Changed = false;
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    for (BasicBlock *BB : RPOT)
+      for (Instruction &I : make_early_inc_range(*BB))
+        if (isRoot(&I))
+          Changed |= reassociate(&I, DL);
+
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+} // end anonymous namespace
+
+extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, PASS_NAME_EXT, LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == PASS_NAME) {
+                    FPM.addPass(ThePass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
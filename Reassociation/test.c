@@ -0,0 +1,32 @@
+// Test cases for the reassociation pass
+
+int constants(int a, int b) {
+  int x = (a + 1) + b + 2;
+  int y = a + (b + 3); // the same value: both become (a + b) + 3
+  return x * y;
+}
+
+int shared_prefix(int a, int b, int c, int d) {
+  int x = c + (b + a);
+  int y = (a + d) + b; // a + b is shared with x after reassociation
+  return x ^ y;
+}
+
+unsigned logic(unsigned a, unsigned b) {
+  unsigned x = (a ^ b) ^ a;   // b
+  unsigned y = (a & b) & a;   // a & b
+  unsigned z = (a | 0) | b;   // a | b
+  return x + y + z;
+}
+
+int mul_zero(int a, int b) {
+  return (a * 2) * (b * 0); // 0
+}
+
+int main(void) {
+  int r = constants(1, 2);
+  r += shared_prefix(1, 2, 3, 4);
+  r += (int)logic(5, 6);
+  r += mul_zero(7, 8);
+  return r;
+}